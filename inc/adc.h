@@ -0,0 +1,82 @@
+//============================================================================
+// adc.h: Scanned, DMA-driven acquisition of every analog input.
+//============================================================================
+
+#ifndef __ADC_H
+#define __ADC_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "converter.h"
+
+// Everything converted on each trigger.  The ADC always scans in channel
+// number order, so these go in the order of channel_numbers[] in adc.c.
+typedef enum
+{
+    ADC_CH_TACH,      // PA4, tach level (edges are timed by TIM14, tach.c)
+    ADC_CH_BUS,       // PA5, bus voltage divider
+    ADC_CH_VOUT,      // PA6, converter output divider
+    ADC_CH_CURRENT,   // PA7, motor current shunt amplifier
+    ADC_CH_TEMP,      // internal temperature sensor
+    ADC_CH_VREFINT,   // internal reference, gives VDDA
+    ADC_CH_COUNT
+} adc_channel_t;
+
+// Sample times are in 48 MHz timer ticks, the same timebase as the PWM and
+// the tach.  The ADC runs synchronously from PCLK/4 (12 MHz, 4 ticks per
+// cycle), so the trigger latency is fixed.  The sampling time is the
+// temperature sensor's 4 us minimum, rounded up to 55.5 cycles.  It
+// applies to every channel.
+#define ADC_TICKS_HZ 48000000
+#define ADC_LATENCY_TICKS 11     // 2.625 cycles, trigger to sampling
+#define ADC_SAMPLE_TICKS 222     // 55.5 cycles
+#define ADC_CONVERSION_TICKS 272 // 55.5 + 12.5 cycles
+#define ADC_TRIGGER_TICKS (ADC_TICKS_HZ / CONV_ADC_HZ)
+
+// middle of a channel's sampling window, after the trigger
+#define ADC_DELAY_TICKS(ch) \
+    (ADC_LATENCY_TICKS + (ch) * ADC_CONVERSION_TICKS + ADC_SAMPLE_TICKS / 2)
+
+// One channel's samples within a block, read in place from the interleaved
+// DMA buffer.  Sample i was taken at time + i * ADC_TRIGGER_TICKS.
+typedef struct
+{
+    const volatile uint16_t *first;
+    uint32_t time;  // ADC_TICKS_HZ ticks, wraps every 89 s
+} adc_view_t;
+
+// CONV_ADC_OVERSAMPLE sequences, handed over together
+typedef struct
+{
+    adc_view_t ch[ADC_CH_COUNT];
+} adc_block_t;
+
+typedef void (*adc_block_fn)(const adc_block_t *block);
+
+// Decimated readings: each block's sum goes through a CIC decimator of
+// ADC_CIC_ORDER, one per channel at that channel's ratio in blocks (the
+// table in adc.c), and comes out as a 16-bit fraction of full scale
+// (4095 raw reads 65520).  Averaging n samples with a least bit or so of
+// noise on them adds log2(n) / 2 bits: 20 samples give the current loop
+// 14, and 256 give the internal channels 16, at 78 Hz.  Order 2 rejects
+// more of the ripple above the output rate, for more delay.  ratio^order
+// must stay under 16384.
+#define ADC_CIC_ORDER 1
+#define ADC_DECIMATE_INTERNAL 64
+
+// The analog watchdog watches one channel in every scan and interrupts
+// only when a sample falls outside [low, high].  The handler gets the
+// first sample of that run outside, the one before it, and the time the
+// first was taken.
+#define ADC_FULL_SCALE 4095
+typedef void (*adc_watchdog_fn)(uint16_t sample, uint16_t before, uint32_t time);
+
+void adc_init(adc_block_fn on_block);
+void adc_watchdog(adc_channel_t ch, adc_watchdog_fn on_exit);
+void adc_watchdog_window(uint16_t low, uint16_t high);
+uint16_t adc_sample(const adc_view_t *view, int i);
+uint16_t adc_mean(const adc_view_t *view);
+bool adc_decimated(adc_channel_t ch, uint16_t *value);
+float adc_vdda(void);
+float adc_temperature(void);
+
+#endif
@@ -0,0 +1,50 @@
+//============================================================================
+// autotune.h: Relay-feedback (Astrom-Hagglund) PID auto-tuner.
+//============================================================================
+
+#ifndef __AUTOTUNE_H
+#define __AUTOTUNE_H
+#include <stdint.h>
+
+typedef enum
+{
+    AUTOTUNE_IDLE,
+    AUTOTUNE_RUNNING,
+    AUTOTUNE_DONE,
+    AUTOTUNE_FAILED
+} autotune_state_t;
+
+typedef struct
+{
+    autotune_state_t state;
+
+    // relay setup
+    int32_t setpoint;
+    int32_t bias;
+    int32_t amplitude;     // relay output swing either side of bias (d)
+    int32_t hysteresis;    // noise band around the setpoint (eps)
+    uint32_t timeout;      // give up after this many steps
+
+    // measurement
+    int relay_high;
+    uint32_t ticks;
+    uint32_t last_rise;
+    int32_t pv_max;
+    int32_t pv_min;
+    int cycles;
+    uint32_t period_sum;
+    int32_t amp_sum;
+
+    // results: ultimate gain/period and the Ziegler-Nichols gains derived
+    // from them, in the units of the loop being tuned (gains per sample)
+    float ku;
+    float tu;              // in steps
+    float pi_kp, pi_ki;
+    float pid_kp, pid_ki, pid_kd;
+} autotune_t;
+
+void autotune_start(autotune_t *at, int32_t setpoint, int32_t bias, int32_t amplitude,
+                    int32_t hysteresis, uint32_t timeout);
+int32_t autotune_step(autotune_t *at, int32_t pv);
+
+#endif
@@ -0,0 +1,27 @@
+//============================================================================
+// control.h: Fixed-point controller building blocks for the motor loops.
+//============================================================================
+
+#ifndef __CONTROL_H
+#define __CONTROL_H
+#include <stdint.h>
+
+// Gains are Q8: a kp of 256 means one output unit per unit of error.
+// The fast loops run from interrupt context on a core with no FPU, so
+// everything in here stays in 32-bit integers.
+#define PI_SHIFT 8
+
+typedef struct
+{
+    int32_t kp;       // proportional gain, Q8
+    int32_t ki;       // integral gain per sample, Q8
+    int32_t integ;    // integrator state, Q8 output units
+    int32_t out_min;
+    int32_t out_max;
+} pi_ctrl_t;
+
+void pi_init(pi_ctrl_t *pi, int32_t kp, int32_t ki, int32_t out_min, int32_t out_max);
+void pi_reset(pi_ctrl_t *pi, int32_t preload);
+int32_t pi_update(pi_ctrl_t *pi, int32_t error, int32_t feedforward);
+
+#endif
@@ -0,0 +1,38 @@
+//============================================================================
+// converter.h: Buck/boost output voltage regulation.
+//============================================================================
+
+#ifndef __CONVERTER_H
+#define __CONVERTER_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "pwm.h"
+
+// Both the bus (PA5) and the converter output (PA6) are read through a
+// 100k/10k divider, so 3.3V at the pin is 36.3V at the terminal.
+#define CONV_DIVIDER_RATIO 11.0f
+#define CONV_ADC_VOLTS (3.3f * CONV_DIVIDER_RATIO)
+
+// The loop runs at a fixed 5 kHz on the average of CONV_ADC_OVERSAMPLE ADC
+// sequences, taken once every CONV_ADC_DECIMATION TIM2 periods.  The PWM
+// frequency can change at run time (pwm_configure()); the decimation
+// follows it and these are the power-up values.
+#define CONV_LOOP_HZ 5000
+#define CONV_ADC_OVERSAMPLE 4
+#define CONV_ADC_HZ (CONV_LOOP_HZ * CONV_ADC_OVERSAMPLE)
+#define CONV_PWM_HZ 240000
+#define CONV_ADC_DECIMATION (CONV_PWM_HZ / CONV_ADC_HZ)
+
+// Lowest supply we will switch from.
+#define BUS_MIN_VOLTAGE 3.0f
+
+extern volatile bool converter_boost_mode;
+
+void converter_set_target(float volts);
+void converter_enable(bool enable);
+void converter_update(uint16_t bus_raw, uint16_t vout_raw);
+void converter_duties(pwm_duties_t *duties);
+float converter_bus_voltage(void);
+float converter_output_voltage(void);
+
+#endif
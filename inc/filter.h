@@ -0,0 +1,73 @@
+//============================================================================
+// filter.h: Fixed-point filter stages for measured sample streams.
+//============================================================================
+
+#ifndef __FILTER_H
+#define __FILTER_H
+#include <stdint.h>
+#include <stdbool.h>
+
+// Like control.h, integers only and no allocation: each stage's history is
+// an array the caller owns, sized at compile time.  None of this touches
+// the hardware, so it builds and runs on a host as it is.
+
+// Moving average over 1 << shift samples, O(1) per sample from a running
+// sum.  Samples up to 2^31 >> shift.
+typedef struct
+{
+    int32_t *ring;
+    int32_t sum;
+    uint8_t shift;
+    uint8_t pos;
+} ring_average_t;
+
+// Median of the last n samples (odd, up to MEDIAN_MAX).  Up to (n - 1) / 2
+// wild samples among the last n never reach the output.
+#define MEDIAN_MAX 7
+
+typedef struct
+{
+    int32_t *window;
+    uint8_t n;
+    uint8_t pos;
+} median_t;
+
+// First-order low-pass, y += (x - y) / 2^shift
+typedef struct
+{
+    int32_t y;
+    uint8_t shift;
+} iir_t;
+
+// CIC decimator: order integrators at the input rate, then order combs
+// on every ratio'th, so one output per ratio inputs.  Order 1 is a boxcar
+// sum.  The gain is ratio^order.  The arithmetic is unsigned and wraps,
+// which the combs undo as long as a full-scale output fits 32 bits.
+#define CIC_MAX_ORDER 3
+
+typedef struct
+{
+    uint32_t integrator[CIC_MAX_ORDER];
+    uint32_t delay[CIC_MAX_ORDER];  // each comb's input one output ago
+    uint16_t ratio;
+    uint16_t count;
+    uint8_t order;
+} cic_t;
+
+void ring_average_init(ring_average_t *f, int32_t *ring, int shift);
+void ring_average_reset(ring_average_t *f, int32_t x);
+int32_t ring_average_update(ring_average_t *f, int32_t x);
+
+void median_init(median_t *f, int32_t *window, int n);
+void median_reset(median_t *f, int32_t x);
+int32_t median_update(median_t *f, int32_t x);
+
+void iir_init(iir_t *f, int shift);
+void iir_reset(iir_t *f, int32_t x);
+int32_t iir_update(iir_t *f, int32_t x);
+
+void cic_init(cic_t *f, int order, int ratio);
+uint32_t cic_gain(const cic_t *f);
+bool cic_update(cic_t *f, uint32_t x, uint32_t *y);
+
+#endif
@@ -0,0 +1,89 @@
+//============================================================================
+// motor_control.h: Cascaded speed and current loops for the H-bridge.
+//============================================================================
+
+#ifndef __MOTOR_CONTROL_H
+#define __MOTOR_CONTROL_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "autotune.h"
+
+// Motor current is read on PA7 from the shunt amplifier: 10 mOhm and a gain
+// of 50 gives 0.5 V/A, so the 3.3V ADC range is 6.6 A.
+#define CURRENT_FULL_SCALE_MA 6600
+
+// The current loop runs every CURRENT_LOOP_DECIMATION converter samples
+// (1 kHz), on the ADC's decimated current over them, and the speed loop
+// every SPEED_LOOP_DECIMATION current loop iterations (100 Hz).
+#define CURRENT_LOOP_DECIMATION 5
+#define SPEED_LOOP_DECIMATION 10
+#define SPEED_LOOP_HZ 100
+
+// The speed loop never asks for more than this.
+#define CURRENT_LIMIT_MA 2000
+
+// Speed loop (speed_loop.c) defaults: mA per rpm of error, Q8.  The
+// scheduler and the auto-tuner move them from here.
+#define SPEED_KP 64
+#define SPEED_KI 8
+
+// Load observer, fed forward into the current reference.  Nominal
+// mechanics, Q8: 2 A accelerates the motor to 6000 rpm in about 200 ms
+// (0.067 mA per rpm/s) and it draws 200 mA unloaded at 6000 rpm (0.033 mA
+// per rpm).  Filter corner is about 5 Hz.  A finished auto-tune turns it
+// off for the gains it sets.
+#define USE_LOAD_OBSERVER 1
+#define LOAD_MA_PER_RPM_S 17
+#define LOAD_MA_PER_RPM 9
+#define LOAD_FILTER_SHIFT 2
+
+// Speed loop auto-tune: settle this long to find the holding current, then
+// swing the relay this far either side of it, and give up after the
+// timeout.  The hysteresis only has to cover tach noise.
+#define AUTOTUNE_TIMEOUT_S 30
+#define AUTOTUNE_SETTLE_S 3
+#define AUTOTUNE_AMPLITUDE_MA (CURRENT_LIMIT_MA / 4)
+#define AUTOTUNE_MIN_AMPLITUDE_MA 50
+#define AUTOTUNE_HYSTERESIS_RPM 5
+
+// The H-bridge is a full bridge on TIM1 (pwm.c).  Direction is the sign of
+// its duty; dynamic braking holds both low sides on in either bridge mode
+// (motor_control_bridge_short()), since zero duty in locked-antiphase is
+// 50/50 switching.
+typedef enum
+{
+    BRAKE_NONE,        // normal drive
+    BRAKE_COAST,       // everything off
+    BRAKE_DYNAMIC,     // low-side short, chopped to hold the current limit
+    BRAKE_PLUG         // drive against the rotation at the current limit
+} brake_mode_t;
+
+void motor_control_init(void);
+void motor_control_set_direction(bool forward);
+bool motor_control_direction(void);
+void motor_control_brake(brake_mode_t mode, int32_t current_limit_ma);
+
+void motor_control_set_speed(float rpm);
+void motor_control_enable(bool enable);
+void motor_control_update(uint16_t current, int32_t speed_rpm);
+int32_t motor_control_bridge_duty(void);
+bool motor_control_bridge_short(void);
+float motor_current(void);
+
+void motor_control_autotune(float rpm);
+autotune_state_t motor_control_autotune_state(void);
+
+// live first-order model (current -> speed) and the speed loop gains it
+// has scheduled, for the diagnostics page
+typedef struct
+{
+    bool model_valid;
+    float rpm_per_a;   // steady-state rpm per amp
+    float tau_s;
+    float speed_kp;    // mA per rpm
+    float speed_ki;    // mA per rpm per speed loop sample
+} motor_diag_t;
+
+void motor_control_diagnostics(motor_diag_t *diag);
+
+#endif
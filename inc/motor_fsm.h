@@ -0,0 +1,58 @@
+//============================================================================
+// motor_fsm.h: Motor supervisory state machine.
+//============================================================================
+
+#ifndef __MOTOR_FSM_H
+#define __MOTOR_FSM_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "motor_control.h"
+
+typedef enum
+{
+    MOTOR_IDLE,
+    MOTOR_PRECHARGE,   // converter up to voltage, H-bridge off
+    MOTOR_RAMP_UP,
+    MOTOR_RUNNING,
+    MOTOR_RAMP_DOWN,
+    MOTOR_BRAKING,     // coasting or actively braking until the motor stops
+    MOTOR_FAULT
+} motor_state_t;
+
+typedef enum
+{
+    MOTOR_EV_START,
+    MOTOR_EV_STOP,
+    MOTOR_EV_TOGGLE,   // start/stop button: start from idle, clear a fault, stop otherwise
+    MOTOR_EV_REVERSE,  // stop, change direction and come back up to speed
+    MOTOR_EV_FAULT
+} motor_event_t;
+
+typedef enum
+{
+    MOTOR_FAULT_NONE,
+    MOTOR_FAULT_SETPOINT,    // output voltage setpoint above what we can make
+    MOTOR_FAULT_SUPPLY,      // bus collapsed while running
+    MOTOR_FAULT_PRECHARGE,   // converter never reached its setpoint
+    MOTOR_FAULT_ESTOP,       // e-stop line tripped the bridge (protection.c)
+    MOTOR_FAULT_OVERCURRENT  // current comparator tripped the bridge
+} motor_fault_t;
+
+// highest output voltage setpoint we accept
+#define MOTOR_MAX_OUTPUT_VOLTAGE 24.0f
+
+// The state machine is stepped at MOTOR_FSM_HZ from the ADC interrupt, the
+// only context that writes the TIM2 output enables.
+#define MOTOR_FSM_HZ 100
+
+void motor_fsm_post(motor_event_t ev);
+void motor_fsm_fault(motor_fault_t fault);
+void motor_fsm_set_setpoint(float volts, float rpm);
+void motor_fsm_set_brake_mode(brake_mode_t mode);
+brake_mode_t motor_fsm_brake_mode(void);
+void motor_fsm_update(int32_t speed_rpm);
+motor_state_t motor_fsm_state(void);
+motor_fault_t motor_fsm_fault_code(void);
+const char *motor_fsm_state_name(void);
+
+#endif
@@ -0,0 +1,23 @@
+//============================================================================
+// motor_id.h: Recursive least squares identification of a first-order
+//             motor model, speed[k] = a * speed[k-1] + b * current[k-1].
+//============================================================================
+
+#ifndef __MOTOR_ID_H
+#define __MOTOR_ID_H
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+    int32_t theta[2];   // a, b in Q16 (normalised units, see motor_id.c)
+    int32_t P[2][2];    // covariance, Q24
+    int32_t y_prev;     // speed, rpm
+    uint32_t samples;
+} motor_id_t;
+
+void motor_id_init(motor_id_t *id);
+void motor_id_update(motor_id_t *id, int32_t speed_rpm, int32_t current_ma);
+bool motor_id_model(const motor_id_t *id, float ts, float *rpm_per_ma, float *tau_s);
+
+#endif
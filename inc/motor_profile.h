@@ -0,0 +1,21 @@
+//============================================================================
+// motor_profile.h: Per-motor drive settings.
+//============================================================================
+
+#ifndef __MOTOR_PROFILE_H
+#define __MOTOR_PROFILE_H
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+    const char *name;        // up to 8 characters for the display
+    uint32_t pwm_hz;         // switching frequency for the bridge and converter
+    uint32_t pwm_min_steps;  // fewest timer counts per period acceptable
+} motor_profile_t;
+
+int motor_profile_count(void);
+bool motor_profile_select(int index);
+const motor_profile_t *motor_profile_current(void);
+
+#endif
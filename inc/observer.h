@@ -0,0 +1,26 @@
+//============================================================================
+// observer.h: Load-torque disturbance observer.
+//============================================================================
+
+#ifndef __OBSERVER_H
+#define __OBSERVER_H
+#include <stdint.h>
+#include <stdbool.h>
+
+// Load torque is expressed as the motor current it takes to hold it, so the
+// estimate can be added straight onto the current reference.
+typedef struct
+{
+    int32_t ma_per_rpm_s;   // inertia: mA per rpm/s of acceleration, Q8
+    int32_t ma_per_rpm;     // viscous drag: mA per rpm, Q8
+    int filter_shift;       // low-pass filter, alpha = 2^-shift
+
+    int32_t speed_prev;
+    int32_t estimate;       // load current, Q8 mA
+    bool primed;
+} load_observer_t;
+
+void load_observer_reset(load_observer_t *ob);
+int32_t load_observer_update(load_observer_t *ob, int32_t current_ma, int32_t speed_rpm, int32_t rate_hz);
+
+#endif
@@ -0,0 +1,30 @@
+//============================================================================
+// protection.h: Hardware e-stop and overcurrent trip on the TIM1 break input.
+//============================================================================
+
+#ifndef __PROTECTION_H
+#define __PROTECTION_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "motor_control.h"
+
+// PA1 (COMP1 +) sees the shunt amplifier through a 2:1 divider and is
+// compared against VREFINT (1.22 V), so the bridge trips at about 4.9 A:
+// clear of the 3 A dynamic braking limit, well inside the switches' rating.
+#define TRIP_DIVIDER 2
+#define TRIP_VREFINT_MV 1220
+#define TRIP_CURRENT_MA (TRIP_VREFINT_MV * TRIP_DIVIDER * CURRENT_FULL_SCALE_MA / 3300)
+
+typedef enum
+{
+    TRIP_NONE,
+    TRIP_ESTOP,        // e-stop line (PB12) open
+    TRIP_OVERCURRENT   // COMP1 saw motor current above TRIP_CURRENT_MA
+} trip_cause_t;
+
+void protection_init(void);
+trip_cause_t protection_cause(void);
+bool protection_active(void);
+bool protection_clear(void);
+
+#endif
@@ -0,0 +1,53 @@
+//============================================================================
+// pwm.h: TIM2 converter and TIM1 H-bridge PWM with sigma-delta dithering
+// and atomic updates.
+//============================================================================
+
+#ifndef __PWM_H
+#define __PWM_H
+#include <stdint.h>
+#include <stdbool.h>
+
+// Duties are Q16 fractions of the PWM period, so they keep their meaning
+// when the frequency changes.
+#define PWM_DUTY_ONE 65536
+
+// TIM2 kernel clock, and the most counts from valley to peak (ARR) a Q16
+// duty can be scaled to without overflowing 32 bits.
+#define PWM_CLOCK_HZ 48000000
+#define PWM_MAX_STEPS 32768
+
+// TIM2 is center-aligned and each update event (valley and peak)
+// DMA-bursts the next frame of a DITHER_LEN pattern into CCR1-CCR4.  At
+// 240 kHz (ARR = 100, 200 counts per period) the effective resolution is
+// 100 * 64 = 6400 compare steps per half period (about 12.6 bits) at the
+// full switching frequency.  DITHER_BITS = 8 gives about 14.6 bits for
+// four times the rebuild cost.
+#define DITHER_BITS 6
+#define DITHER_LEN (1 << DITHER_BITS)
+
+// one set of duties, committed together
+typedef struct
+{
+    int32_t bridge;      // H-bridge (TIM1), negative drives in reverse
+    bool bridge_short;   // both low sides on instead, in either bridge mode
+    uint32_t boost;      // boost switch, TIM2 CCR3
+    uint32_t buck;       // buck switch, TIM2 CCR4
+} pwm_duties_t;
+
+typedef enum
+{
+    BRIDGE_SIGN_MAGNITUDE,    // one leg switches, the other holds low
+    BRIDGE_LOCKED_ANTIPHASE   // legs complementary, 50% is standstill
+} bridge_mode_t;
+
+void pwm_init(void);
+void pwm_commit(const pwm_duties_t *duties);
+uint32_t pwm_configure(uint32_t hz, uint32_t min_steps);
+uint32_t pwm_frequency(void);
+uint32_t pwm_resolution(void);
+bool pwm_bridge_mode(bridge_mode_t mode);
+bridge_mode_t pwm_bridge_get_mode(void);
+void pwm_bridge_enable(bool on);
+
+#endif
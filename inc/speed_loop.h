@@ -0,0 +1,35 @@
+//============================================================================
+// speed_loop.h: Speed PI with load feedforward and relay auto-tune, one
+//               call per speed loop period.
+//============================================================================
+
+#ifndef __SPEED_LOOP_H
+#define __SPEED_LOOP_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "control.h"
+#include "observer.h"
+#include "autotune.h"
+
+typedef struct
+{
+    pi_ctrl_t pi;              // mA per rpm, Q8
+    load_observer_t obs;
+    bool feedforward;          // add the load estimate to the reference
+    int32_t load_ff_ma;
+
+    autotune_t tuner;
+    volatile bool tuning;
+    bool new_gains;            // the tuner just set pi; the caller clears it
+    int32_t tune_rpm;
+    int tune_settle;           // steps before the relay starts
+    int32_t tune_hold_acc;
+} speed_loop_t;
+
+void speed_loop_init(speed_loop_t *s);
+void speed_loop_reset(speed_loop_t *s);
+void speed_loop_autotune(speed_loop_t *s, int32_t rpm);
+int32_t speed_loop_step(speed_loop_t *s, int32_t setpoint_rpm, int32_t speed_rpm,
+                        int32_t current_ma);
+
+#endif
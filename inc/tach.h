@@ -0,0 +1,64 @@
+//============================================================================
+// tach.h: Tachometer speed measurement by timer input capture.
+//============================================================================
+
+#ifndef __TACH_H
+#define __TACH_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "adc.h"
+
+// TIM14 runs from the undivided 48 MHz timer clock, ~20.8 ns per tick.
+#define TACH_CLOCK_HZ 48000000
+#define TACH_PULSES_PER_REV 1
+
+// The M/T window is sized from the last estimate to hold about
+// TACH_WINDOW_EDGES edges, within TACH_WINDOW_MIN_MS..TACH_WINDOW_MAX_MS.
+// The minimum caps the estimate rate, and with it the time spent in the
+// filter chain, however fast the edges come.  Below TACH_WINDOW_EDGES /
+// TACH_WINDOW_MAX_MS edges a second a window takes one tach period anyway.
+#define TACH_WINDOW_EDGES 4
+#define TACH_WINDOW_MIN_MS 2
+#define TACH_WINDOW_MAX_MS 10
+
+// tach_update() does its work this often while stopped, and four times a
+// window while running; other calls return straight away.
+#define TACH_WATCH_MS 20
+
+// No edge for this long means the motor has stopped, so it sets the lowest
+// speed measured: 60000 / (TACH_STALL_MS * TACH_PULSES_PER_REV) rpm, 6 rpm
+// here.  Once running, a stop is seen after two expected periods anyway.
+// At most 89000 (32-bit ticks).
+#define TACH_STALL_MS 10000
+
+// Filter chain for the M/T estimates, in this order: median of
+// TACH_MEDIAN_N (1 leaves it out), moving average over 1 << TACH_AVERAGE_SHIFT,
+// then a first-order IIR with alpha 1 / 2^TACH_IIR_SHIFT (0 leaves either
+// out).  Each stage costs about one window of lag.
+#define TACH_MEDIAN_N 3
+#define TACH_AVERAGE_SHIFT 1
+#define TACH_IIR_SHIFT 1
+
+// The level detector ignores a tach swinging less than this, in raw ADC
+// counts (about 0.1 V).
+#define TACH_MIN_SWING_RAW 124
+
+// level detector calibration, raw ADC counts
+typedef struct
+{
+    uint16_t min;      // running minimum of the signal
+    uint16_t max;      // running maximum
+    uint16_t rising;   // an edge counts on crossing this upwards...
+    uint16_t falling;  // ...and the next only after dropping below this
+    bool valid;        // swing is at least TACH_MIN_SWING_RAW
+} tach_levels_t;
+
+void tach_init(void);
+void tach_level(const adc_view_t *view);
+void tach_update(void);
+void tach_levels(tach_levels_t *levels);
+bool tach_using_capture(void);
+float tach_rpm(void);
+uint32_t tach_period_ticks(void);
+
+#endif
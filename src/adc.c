@@ -0,0 +1,294 @@
+//============================================================================
+// adc.c: Scanned, DMA-driven acquisition of every analog input.
+//
+// Each TIM3 trigger converts the whole channel list in one scan, and DMA1
+// Channel 1 drops the results, interleaved, into ADC_array[].  The buffer
+// holds two blocks of CONV_ADC_OVERSAMPLE scans.  The half-transfer and
+// transfer-complete interrupts each pass a finished block on while the DMA
+// fills the other, so the CPU does nothing per conversion.  Consumers get
+// one adc_view_t per channel.  A view strides through the block in place
+// and carries the time its first sample was taken, so nothing is copied
+// to de-interleave it.
+//
+// Channels that want more resolution than the 12 bits, at a lower rate,
+// get a CIC decimator over their block sums (filter.c).  It runs before
+// the block is passed on, and a consumer picks up a fresh reading in the
+// block it appears.
+//
+// A block's times come from counting blocks: triggers are exactly
+// ADC_TRIGGER_TICKS apart and the ADC clock is locked to them.
+//
+// The analog watchdog compares one channel against a window as each
+// sample converts, and interrupts only when a sample lands outside it.
+// Its handler finds that sample in ADC_array[] from the DMA's position and
+// gives it the same timestamp a block would.
+//============================================================================
+
+#include "stm32f0xx.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "filter.h"
+#include "motor_control.h"
+#include "adc.h"
+
+#define BLOCK_LEN (ADC_CH_COUNT * CONV_ADC_OVERSAMPLE)
+#define SCANS (2 * CONV_ADC_OVERSAMPLE)
+
+// factory calibration, taken at 3.3 V VDDA
+#define TS_CAL1 (*(const uint16_t *)0x1FFFF7B8)     // 30 C
+#define TS_CAL2 (*(const uint16_t *)0x1FFFF7C2)     // 110 C
+#define VREFINT_CAL (*(const uint16_t *)0x1FFFF7BA)
+
+static const uint8_t channel_numbers[ADC_CH_COUNT] = {
+    [ADC_CH_TACH]    = 4,
+    [ADC_CH_BUS]     = 5,
+    [ADC_CH_VOUT]    = 6,
+    [ADC_CH_CURRENT] = 7,
+    [ADC_CH_TEMP]    = 16,
+    [ADC_CH_VREFINT] = 17,
+};
+
+// decimation ratio in blocks, 0 for none
+static const uint16_t decimation[ADC_CH_COUNT] = {
+    [ADC_CH_CURRENT] = CURRENT_LOOP_DECIMATION,  // one per current loop
+    [ADC_CH_TEMP]    = ADC_DECIMATE_INTERNAL,
+    [ADC_CH_VREFINT] = ADC_DECIMATE_INTERNAL,
+};
+
+static volatile uint16_t ADC_array[2 * BLOCK_LEN];
+static cic_t decimators[ADC_CH_COUNT];
+static uint32_t decimator_scale[ADC_CH_COUNT];
+static volatile uint16_t decimated[ADC_CH_COUNT];
+static uint32_t fresh = 0;  // channels with a new reading this block
+
+static adc_block_fn block_handler;
+static adc_watchdog_fn watchdog_handler;
+static adc_channel_t watchdog_channel;
+static uint32_t block_count = 0;
+
+//============================================================================
+// adc_init()
+// Call before TIM3 starts triggering.  on_block runs in the DMA interrupt
+// for every block.
+//============================================================================
+void adc_init(adc_block_fn on_block)
+{
+    block_handler = on_block;
+    for (int ch = 0; ch < ADC_CH_COUNT; ch++) {
+        if (decimation[ch]) {
+            cic_init(&decimators[ch], ADC_CIC_ORDER, decimation[ch]);
+            decimator_scale[ch] = cic_gain(&decimators[ch]) * CONV_ADC_OVERSAMPLE;
+        }
+    }
+
+    RCC->AHBENR |= RCC_AHBENR_GPIOAEN;
+    RCC->APB2ENR |= RCC_APB2ENR_ADC1EN;
+    for (int ch = 0; ch < ADC_CH_COUNT; ch++) {
+        if (channel_numbers[ch] < 8)
+            GPIOA->MODER |= 3 << (2 * channel_numbers[ch]);  // analog
+    }
+
+    // PCLK/4, synchronous to the timers; set before calibrating
+    ADC1->CFGR2 = ADC_CFGR2_CKMODE_1;
+    ADC1->CR |= ADC_CR_ADCAL;
+    while (ADC1->CR & ADC_CR_ADCAL);
+    ADC1->CR |= ADC_CR_ADEN;
+    while (!(ADC1->ISR & ADC_ISR_ADRDY));
+
+    ADC1->CHSELR = 0;
+    for (int ch = 0; ch < ADC_CH_COUNT; ch++)
+        ADC1->CHSELR |= 1 << channel_numbers[ch];
+    ADC->CCR |= ADC_CCR_TSEN | ADC_CCR_VREFEN;
+
+    // 55.5 cycles; the whole scan takes ADC_CH_COUNT conversions, well
+    // inside ADC_TRIGGER_TICKS
+    ADC1->SMPR = ADC_SMPR_SMP_2 | ADC_SMPR_SMP_0;
+
+    // hardware trigger on TIM3_TRGO (EXTSEL = 011), rising edge
+    ADC1->CFGR1 |= ADC_CFGR1_EXTSEL_1 | ADC_CFGR1_EXTSEL_0;
+    ADC1->CFGR1 |= ADC_CFGR1_EXTEN_0;
+    // keep the newest sample if the DMA is ever late
+    ADC1->CFGR1 |= ADC_CFGR1_OVRMOD;
+
+    if (watchdog_handler) {
+        // open all the way, so it never trips until a window is set
+        ADC1->TR = (uint32_t)ADC_FULL_SCALE << 16;
+        ADC1->CFGR1 |= ADC_CFGR1_AWDEN | ADC_CFGR1_AWDSGL
+                     | (uint32_t)channel_numbers[watchdog_channel] << 26;
+        ADC1->ISR = ADC_ISR_AWD;
+        ADC1->IER |= ADC_IER_AWDIE;
+        NVIC->ISER[0] |= 1 << ADC1_COMP_IRQn;
+    }
+
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+    DMA1_Channel1->CCR &= ~DMA_CCR_EN;
+    DMA1->RMPCR = (DMA1->RMPCR & ~0x0000000F) | DMA_RMPCR1_CH1_ADC;  // CH1 field
+    DMA1_Channel1->CPAR = (uint32_t)&ADC1->DR;
+    DMA1_Channel1->CMAR = (uint32_t)ADC_array;
+    DMA1_Channel1->CNDTR = 2 * BLOCK_LEN;
+    DMA1_Channel1->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_MSIZE_0 | DMA_CCR_PSIZE_0
+                       | DMA_CCR_HTIE | DMA_CCR_TCIE;
+    DMA1_Channel1->CCR |= DMA_CCR_EN;
+    ADC1->CFGR1 |= ADC_CFGR1_DMACFG | ADC_CFGR1_DMAEN;
+    NVIC->ISER[0] |= 1 << DMA1_Ch1_IRQn;
+
+    ADC1->CR |= ADC_CR_ADSTART;  // arm, conversions start on each trigger
+}
+
+//============================================================================
+// adc_watchdog()
+// Call before adc_init(); the channel can't change once the ADC is running.
+// on_exit runs in the ADC interrupt.
+//============================================================================
+void adc_watchdog(adc_channel_t ch, adc_watchdog_fn on_exit)
+{
+    watchdog_channel = ch;
+    watchdog_handler = on_exit;
+}
+
+// Takes effect from the next conversion.
+void adc_watchdog_window(uint16_t low, uint16_t high)
+{
+    ADC1->TR = (uint32_t)high << 16 | low;
+}
+
+uint16_t adc_sample(const adc_view_t *view, int i)
+{
+    return view->first[i * ADC_CH_COUNT];
+}
+
+uint16_t adc_mean(const adc_view_t *view)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < CONV_ADC_OVERSAMPLE; i++)
+        sum += view->first[i * ADC_CH_COUNT];
+    return sum / CONV_ADC_OVERSAMPLE;
+}
+
+//============================================================================
+// adc_decimated()
+// A channel's newest decimated reading, 16 bits of full scale.  True only
+// in the block that produced it, so a consumer in the block handler runs
+// at the decimated rate.
+//============================================================================
+bool adc_decimated(adc_channel_t ch, uint16_t *value)
+{
+    *value = decimated[ch];
+    return fresh & (1 << ch);
+}
+
+//============================================================================
+// adc_vdda()
+// The supply the ADC is converting against, in volts, from VREFINT.
+//============================================================================
+float adc_vdda(void)
+{
+    uint16_t vrefint = decimated[ADC_CH_VREFINT];
+    if (vrefint == 0)
+        return 3.3f;
+    return 3.3f * (VREFINT_CAL << 4) / vrefint;
+}
+
+//============================================================================
+// adc_temperature()
+// Die temperature in degrees C, between the two factory points and
+// corrected for VDDA.
+//============================================================================
+float adc_temperature(void)
+{
+    float ts = decimated[ADC_CH_TEMP] / 16.0f * adc_vdda() / 3.3f;
+    return 30.0f + (ts - TS_CAL1) * (110.0f - 30.0f) / (TS_CAL2 - TS_CAL1);
+}
+
+static void hand_over(const volatile uint16_t *data)
+{
+    adc_block_t block;
+    uint32_t start = block_count * CONV_ADC_OVERSAMPLE * ADC_TRIGGER_TICKS;
+    block_count++;
+
+    fresh = 0;
+    for (int ch = 0; ch < ADC_CH_COUNT; ch++) {
+        block.ch[ch].first = &data[ch];
+        block.ch[ch].time = start + ADC_DELAY_TICKS(ch);
+
+        if (decimation[ch]) {
+            uint32_t sum = 0;
+            uint32_t y;
+            for (int i = 0; i < CONV_ADC_OVERSAMPLE; i++)
+                sum += data[ch + i * ADC_CH_COUNT];
+            if (cic_update(&decimators[ch], sum, &y)) {
+                decimated[ch] = (y << 4) / decimator_scale[ch];
+                fresh |= 1 << ch;
+            }
+        }
+    }
+
+    if (block_handler)
+        block_handler(&block);
+}
+
+//============================================================================
+// DMA1_CH1_IRQHandler()
+// Half-transfer: the first block of ADC_array[] is complete and the DMA
+// has moved on to the second; transfer-complete: the other way round.
+//============================================================================
+void DMA1_CH1_IRQHandler(void)
+{
+    uint32_t isr = DMA1->ISR;
+    if (isr & DMA_ISR_HTIF1) {
+        DMA1->IFCR = DMA_IFCR_CHTIF1;
+        hand_over(&ADC_array[0]);
+    }
+    if (isr & DMA_ISR_TCIF1) {
+        DMA1->IFCR = DMA_IFCR_CTCIF1;
+        hand_over(&ADC_array[BLOCK_LEN]);
+    }
+}
+
+//============================================================================
+// ADC_COMP_IRQHandler()
+// The watchdog tripped on some conversion of its channel, but the flag
+// doesn't say which, and this may have waited behind a block.  So start
+// from the newest sample of the channel and walk back to the first of the
+// run outside the window.
+//============================================================================
+void ADC_COMP_IRQHandler(void)
+{
+    if (!(ADC1->ISR & ADC_ISR_AWD))
+        return;
+    ADC1->ISR = ADC_ISR_AWD;
+
+    // CNDTR first: a block finishing after it is read leaves its flag
+    // pending, and then counts as handed over
+    int ch = watchdog_channel;
+    int newest = 2 * BLOCK_LEN - DMA1_Channel1->CNDTR - 1 - ch;
+    uint32_t blocks = block_count;
+    if (DMA1->ISR & (blocks & 1 ? DMA_ISR_TCIF1 : DMA_ISR_HTIF1))
+        blocks++;
+    if (newest < 0)
+        newest += 2 * BLOCK_LEN;
+    int scan = newest / ADC_CH_COUNT;
+
+    // the block the DMA is filling has the parity of the blocks done
+    uint32_t half = scan / CONV_ADC_OVERSAMPLE;
+    uint32_t block = (blocks & 1) == half ? blocks : blocks - 1;
+    uint32_t n = block * CONV_ADC_OVERSAMPLE + scan % CONV_ADC_OVERSAMPLE;
+
+    uint32_t tr = ADC1->TR;
+    uint16_t low = tr & 0xFFF;
+    uint16_t high = (tr >> 16) & 0xFFF;
+    uint16_t sample = ADC_array[scan * ADC_CH_COUNT + ch];
+    uint16_t before = sample;
+    for (int k = 1; k < SCANS; k++) {
+        int prev = scan ? scan - 1 : SCANS - 1;
+        before = ADC_array[prev * ADC_CH_COUNT + ch];
+        if (before >= low && before <= high)
+            break;
+        sample = before;
+        scan = prev;
+        n--;
+    }
+
+    if (watchdog_handler)
+        watchdog_handler(sample, before, n * ADC_TRIGGER_TICKS + ADC_DELAY_TICKS(ch));
+}
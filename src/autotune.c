@@ -0,0 +1,108 @@
+//============================================================================
+// autotune.c: Relay-feedback (Astrom-Hagglund) PID auto-tuner.
+//
+// The loop output is replaced by a relay that switches between bias + d and
+// bias - d whenever the measured value crosses the setpoint.  Most plants
+// settle into a limit cycle whose period is the ultimate period Tu, and
+// whose amplitude a gives the ultimate gain Ku = 4d / (pi * sqrt(a^2 - eps^2)).
+// Gains then follow from the classic Ziegler-Nichols table.
+//
+// Nothing in here touches hardware, step it at the rate of the loop being
+// tuned with that loop's measurement.
+//============================================================================
+
+#include <stdint.h>
+#include <math.h>
+#include "autotune.h"
+
+// the first cycles are still settling from the step, skip them
+#define SETTLE_CYCLES 2
+#define MEASURE_CYCLES 4
+
+void autotune_start(autotune_t *at, int32_t setpoint, int32_t bias, int32_t amplitude,
+                    int32_t hysteresis, uint32_t timeout)
+{
+    at->state = AUTOTUNE_RUNNING;
+    at->setpoint = setpoint;
+    at->bias = bias;
+    at->amplitude = amplitude;
+    at->hysteresis = hysteresis;
+    at->timeout = timeout;
+
+    at->relay_high = 1;
+    at->ticks = 0;
+    at->last_rise = 0;
+    at->pv_max = INT32_MIN;
+    at->pv_min = INT32_MAX;
+    at->cycles = 0;
+    at->period_sum = 0;
+    at->amp_sum = 0;
+}
+
+static void autotune_finish(autotune_t *at)
+{
+    float d = at->amplitude;
+    float a = (float)at->amp_sum / MEASURE_CYCLES;
+    float eps = at->hysteresis;
+
+    if (a <= eps) {
+        at->state = AUTOTUNE_FAILED;
+        return;
+    }
+    at->ku = 4.0f * d / (3.14159265f * sqrtf(a * a - eps * eps));
+    at->tu = (float)at->period_sum / MEASURE_CYCLES;
+
+    // PI: Kp = 0.45 Ku, Ti = Tu / 1.2
+    at->pi_kp = 0.45f * at->ku;
+    at->pi_ki = at->pi_kp * 1.2f / at->tu;
+
+    // PID: Kp = 0.6 Ku, Ti = Tu / 2, Td = Tu / 8
+    at->pid_kp = 0.6f * at->ku;
+    at->pid_ki = at->pid_kp * 2.0f / at->tu;
+    at->pid_kd = at->pid_kp * at->tu / 8.0f;
+
+    at->state = AUTOTUNE_DONE;
+}
+
+//============================================================================
+// autotune_step()
+// Feed one measurement, get the relay output to apply until the next step.
+//============================================================================
+int32_t autotune_step(autotune_t *at, int32_t pv)
+{
+    if (at->state != AUTOTUNE_RUNNING)
+        return at->bias;
+
+    at->ticks++;
+    if (at->ticks > at->timeout) {
+        at->state = AUTOTUNE_FAILED;
+        return at->bias;
+    }
+
+    if (pv > at->pv_max)
+        at->pv_max = pv;
+    if (pv < at->pv_min)
+        at->pv_min = pv;
+
+    if (at->relay_high && pv > at->setpoint + at->hysteresis) {
+        at->relay_high = 0;
+    } else if (!at->relay_high && pv < at->setpoint - at->hysteresis) {
+        // a full cycle ends each time the relay switches back up
+        at->relay_high = 1;
+        if (at->cycles >= SETTLE_CYCLES) {
+            at->period_sum += at->ticks - at->last_rise;
+            at->amp_sum += (at->pv_max - at->pv_min) / 2;
+        }
+        at->cycles++;
+        at->last_rise = at->ticks;
+        at->pv_max = INT32_MIN;
+        at->pv_min = INT32_MAX;
+
+        if (at->cycles >= SETTLE_CYCLES + MEASURE_CYCLES) {
+            autotune_finish(at);
+            return at->bias;
+        }
+    }
+
+    return at->relay_high ? at->bias + at->amplitude : at->bias - at->amplitude;
+}
@@ -0,0 +1,43 @@
+//============================================================================
+// control.c: Fixed-point controller building blocks for the motor loops.
+//============================================================================
+
+#include <stdint.h>
+#include "control.h"
+
+void pi_init(pi_ctrl_t *pi, int32_t kp, int32_t ki, int32_t out_min, int32_t out_max)
+{
+    pi->kp = kp;
+    pi->ki = ki;
+    pi->out_min = out_min;
+    pi->out_max = out_max;
+    pi->integ = 0;
+}
+
+// Load the integrator so the next output starts from `preload` on top of
+// the feedforward term.  Used for bumpless restarts.
+void pi_reset(pi_ctrl_t *pi, int32_t preload)
+{
+    pi->integ = preload << PI_SHIFT;
+}
+
+// One controller step.  The integrator is frozen whenever the output is
+// pinned against a limit and the error would push it further in, so the
+// loop comes straight back out of saturation instead of unwinding.
+int32_t pi_update(pi_ctrl_t *pi, int32_t error, int32_t feedforward)
+{
+    int32_t integ = pi->integ + pi->ki * error;
+    int32_t out = feedforward + ((pi->kp * error + integ) >> PI_SHIFT);
+
+    if (out > pi->out_max) {
+        out = pi->out_max;
+        if (error > 0)
+            integ = pi->integ;
+    } else if (out < pi->out_min) {
+        out = pi->out_min;
+        if (error < 0)
+            integ = pi->integ;
+    }
+    pi->integ = integ;
+    return out;
+}
@@ -0,0 +1,120 @@
+//============================================================================
+// converter.c: Buck/boost output voltage regulation.
+//
+// The buck (TIM2 CH4) and boost (TIM2 CH3) switches are driven from a single
+// control variable: the conversion ratio Vout/Vbus in Q12.  Below 1.0 only
+// the buck switches, above 1.0 the buck is held on and the boost switches.
+// The PI regulator works on that ratio, so its integrator carries straight
+// across the buck/boost boundary and the handoff has no step in it.  The
+// duties go out through pwm_commit(), which dithers them below one timer
+// count and updates both switches in the same PWM period.
+//============================================================================
+
+#include "stm32f0xx.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "control.h"
+#include "converter.h"
+
+#define RATIO_ONE 4096
+#define RATIO_MAX (RATIO_ONE * 4)  // boost duty limited to 75%
+
+// band around a ratio of 1.0 before changing mode, so a setpoint sitting at
+// the supply voltage doesn't toggle between buck and boost every sample
+#define RATIO_HYSTERESIS (RATIO_ONE / 64)
+
+// PI gains in ratio LSBs per ADC count of output error (Q8).  At a 12V bus
+// one ratio LSB moves the output by about a third of an ADC count, giving a
+// crossover of roughly 50 Hz, well under the output filter resonance.
+#define VOUT_KP 64
+#define VOUT_KI 48
+
+// bus filter time constant is 2^9 samples, about 100 ms at 5 kHz
+#define BUS_FILTER_SHIFT 9
+
+#define VOLTS_TO_RAW(v) ((v) * 4096.0f / CONV_ADC_VOLTS)
+#define RAW_TO_VOLTS(r) ((r) * CONV_ADC_VOLTS / 4096.0f)
+#define BUS_MIN_RAW ((int32_t)VOLTS_TO_RAW(BUS_MIN_VOLTAGE))
+
+volatile bool converter_boost_mode = false;
+
+static pi_ctrl_t vout_pi = { VOUT_KP, VOUT_KI, 0, 0, RATIO_MAX };
+static volatile int32_t vout_target_raw = 0;
+static volatile bool converter_on = false;
+static int32_t bus_filt = 0;  // bus reading in Q16 ADC counts
+static volatile uint16_t vout_last = 0;
+static uint32_t buck_duty = 0;
+static uint32_t boost_duty = 0;
+
+void converter_set_target(float volts)
+{
+    vout_target_raw = VOLTS_TO_RAW(volts);
+}
+
+void converter_enable(bool enable)
+{
+    converter_on = enable;
+}
+
+float converter_bus_voltage(void)
+{
+    return RAW_TO_VOLTS(bus_filt >> 16);
+}
+
+float converter_output_voltage(void)
+{
+    return RAW_TO_VOLTS(vout_last);
+}
+
+//============================================================================
+// converter_duties()
+// The switch duties from the last update, as Q16 fractions of the period,
+// for pwm_commit().
+//============================================================================
+void converter_duties(pwm_duties_t *duties)
+{
+    duties->boost = boost_duty;
+    duties->buck = buck_duty;
+}
+
+//============================================================================
+// converter_update()
+// Called from the ADC interrupt with a fresh PWM-synchronous sample set.
+//============================================================================
+void converter_update(uint16_t bus_raw, uint16_t vout_raw)
+{
+    uint32_t buck = 0;
+    uint32_t boost = 0;
+
+    if (bus_filt == 0)
+        bus_filt = (int32_t)bus_raw << 16;
+    bus_filt += (((int32_t)bus_raw << 16) - bus_filt) >> BUS_FILTER_SHIFT;
+    vout_last = vout_raw;
+
+    int32_t bus = bus_filt >> 16;
+
+    if (!converter_on || vout_target_raw == 0 || bus < BUS_MIN_RAW) {
+        pi_reset(&vout_pi, 0);
+        converter_boost_mode = false;
+    } else {
+        // open-loop ratio from the measured bus, trimmed by the regulator
+        int32_t ff = (vout_target_raw << 12) / bus;
+        int32_t ratio = pi_update(&vout_pi, vout_target_raw - vout_raw, ff);
+
+        if (converter_boost_mode && ratio < RATIO_ONE - RATIO_HYSTERESIS)
+            converter_boost_mode = false;
+        else if (!converter_boost_mode && ratio > RATIO_ONE + RATIO_HYSTERESIS)
+            converter_boost_mode = true;
+
+        // Q12 ratio to Q16 duty
+        if (!converter_boost_mode) {
+            buck = ratio >= RATIO_ONE ? PWM_DUTY_ONE : (uint32_t)ratio << 4;
+        } else {
+            buck = PWM_DUTY_ONE;
+            boost = ratio <= RATIO_ONE ? 0 : PWM_DUTY_ONE - ((uint32_t)PWM_DUTY_ONE << 12) / ratio;
+        }
+    }
+
+    buck_duty = buck;
+    boost_duty = boost;
+}
@@ -0,0 +1,119 @@
+//============================================================================
+// filter.c: Fixed-point filter stages for measured sample streams.
+//============================================================================
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "filter.h"
+
+void ring_average_init(ring_average_t *f, int32_t *ring, int shift)
+{
+    f->ring = ring;
+    f->shift = shift;
+    ring_average_reset(f, 0);
+}
+
+// Fill the history with x, so the average starts there instead of ramping
+// up from zero.
+void ring_average_reset(ring_average_t *f, int32_t x)
+{
+    for (int i = 0; i < (1 << f->shift); i++)
+        f->ring[i] = x;
+    f->sum = x << f->shift;
+    f->pos = 0;
+}
+
+int32_t ring_average_update(ring_average_t *f, int32_t x)
+{
+    f->sum += x - f->ring[f->pos];
+    f->ring[f->pos] = x;
+    f->pos = (f->pos + 1) & ((1 << f->shift) - 1);
+    return f->sum >> f->shift;
+}
+
+void median_init(median_t *f, int32_t *window, int n)
+{
+    f->window = window;
+    f->n = n;
+    median_reset(f, 0);
+}
+
+void median_reset(median_t *f, int32_t x)
+{
+    for (int i = 0; i < f->n; i++)
+        f->window[i] = x;
+    f->pos = 0;
+}
+
+// Insertion sort of a copy: n is at most MEDIAN_MAX, where that beats
+// anything cleverer.
+int32_t median_update(median_t *f, int32_t x)
+{
+    int32_t sorted[MEDIAN_MAX];
+
+    f->window[f->pos] = x;
+    if (++f->pos >= f->n)
+        f->pos = 0;
+
+    for (int i = 0; i < f->n; i++) {
+        int32_t v = f->window[i];
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > v; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = v;
+    }
+    return sorted[f->n / 2];
+}
+
+void iir_init(iir_t *f, int shift)
+{
+    f->shift = shift;
+    f->y = 0;
+}
+
+void iir_reset(iir_t *f, int32_t x)
+{
+    f->y = x;
+}
+
+int32_t iir_update(iir_t *f, int32_t x)
+{
+    f->y += (x - f->y) >> f->shift;
+    return f->y;
+}
+
+void cic_init(cic_t *f, int order, int ratio)
+{
+    f->order = order;
+    f->ratio = ratio;
+    f->count = 0;
+    for (int i = 0; i < CIC_MAX_ORDER; i++)
+        f->integrator[i] = f->delay[i] = 0;
+}
+
+uint32_t cic_gain(const cic_t *f)
+{
+    uint32_t gain = 1;
+    for (int i = 0; i < f->order; i++)
+        gain *= f->ratio;
+    return gain;
+}
+
+// True, with the output in *y, on every ratio'th input.  The first order
+// outputs are still filling the combs.
+bool cic_update(cic_t *f, uint32_t x, uint32_t *y)
+{
+    for (int i = 0; i < f->order; i++)
+        x = f->integrator[i] += x;
+    if (++f->count < f->ratio)
+        return false;
+    f->count = 0;
+
+    for (int i = 0; i < f->order; i++) {
+        uint32_t d = x - f->delay[i];
+        f->delay[i] = x;
+        x = d;
+    }
+    *y = x;
+    return true;
+}
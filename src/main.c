@@ -17,6 +17,14 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "lcd.h"  // library provided by Niraj Menon for driving LCD display
+#include "converter.h"
+#include "pwm.h"
+#include "motor_control.h"
+#include "motor_fsm.h"
+#include "motor_profile.h"
+#include "protection.h"
+#include "tach.h"
+#include "adc.h"
 
 void LCD_Setup();
 void LCD_Clear(u16 Color);
@@ -58,15 +66,28 @@ char *data_fields[] = {
 bool enter_key_pressed = false;
 bool process_num_triggered = false;
 
+// diagnostics page, toggled from the keypad and redrawn in SysTick
+bool diag_page = false;
+bool page_change_pending = false;
+
+// auto-tune starts the motor, so it takes 'D' twice on the diagnostics page
+bool tune_armed = false;
+
+// milliseconds from the keypad timer, and the last start/stop button edge
+#define BUTTON_DEBOUNCE_MS 50
+volatile uint32_t keypad_ms = 0;
+uint32_t button_last_ms = 0;
+
 float motor_des_voltage = 0;
 float motor_des_speed = 0;
 float motor_max_speed = 0;
 int updated_value = 0;
 float motor_feedback = 0;
 float live_speed_reading = 0;
-bool motor_running = false;
 bool initial_startup = true;
-bool voltage_too_high = false;
+
+// measured supply (bus) voltage, filtered by the converter loop
+float bus_voltage = 0;
 
 
 
@@ -77,13 +98,13 @@ uint8_t top_field_pos = 0;
 uint8_t bottom_field_pos = 0;
 
 
-bool pwm_enable = false;
-
 void init_display_fields(char *data_fields_arr[]);
 void update_display_field(char *updated_string);
 void draw_cursor();
 void erase_cursor();
 void process_keyPress(char key);
+void draw_entered_values();
+void draw_diagnostics(bool labels);
 /* display block end */
 
 void init_pins();
@@ -114,8 +135,7 @@ void enable_dma(void);
 void init_spi1();
 
 
-void setup_adc(void);
-void TIM3_IRQHandler();
+void adc_block(const adc_block_t *block);
 void init_tim3(void);
 
 void setup_tim7();
@@ -132,11 +152,6 @@ void init_exti();
  * placeholder global variable for dma
  */
 int display[32];
-int ADC_array[32];
-
-void mysleep(int time) {
-    for(int n = 0; n < time; n++);
-}
 
 int main(void) {
 	row_inc = pixel_row / num_table_rows;
@@ -149,18 +164,32 @@ int main(void) {
 	bottom_field_pos = row_inc * (num_table_rows - 2);
 
 
-	NVIC_SetPriority(SysTick_IRQn, 20);
-	NVIC_SetPriority(TIM2_IRQn, 40);
-	NVIC_SetPriority(TIM3_IRQn, 40);
-	NVIC_SetPriority(TIM7_IRQn, 40);
-	NVIC_SetPriority(EXTI4_15_IRQn, 10);
+	// the M0 only implements priorities 0-3.  The converter loop runs in the
+	// ADC DMA interrupt and must be able to preempt the slow LCD drawing in
+	// SysTick.  The PWM pattern swap has to land inside half a PWM period, so it
+	// goes ahead of everything else
+	NVIC_SetPriority(DMA1_Ch2_3_DMA2_Ch1_2_IRQn, 0);
+	NVIC_SetPriority(DMA1_Ch1_IRQn, 1);
+	NVIC_SetPriority(TIM14_IRQn, 1);  // must count every tach overflow
+	NVIC_SetPriority(ADC1_COMP_IRQn, 1);  // tach level watchdog, with the blocks
+	NVIC_SetPriority(EXTI4_15_IRQn, 2);
+	NVIC_SetPriority(TIM1_BRK_UP_TRG_COM_IRQn, 2);  // outputs are already off
+	NVIC_SetPriority(TIM2_IRQn, 2);
+	NVIC_SetPriority(TIM7_IRQn, 2);
+	NVIC_SetPriority(SysTick_IRQn, 3);
 
 	// generic pin setup
     init_pins();
 
+    // tach input capture, and the level watchdog adc_init sets up
+    tach_init();
+
+    // speed loop defaults, before the ADC block runs it
+    motor_control_init();
+
     // adc setup
-    setup_adc();  // adc loop
-    init_tim3();  // timer for adc
+    adc_init(adc_block);  // scanned inputs, triggered by tim3
+    init_tim3();  // timer for adc, counts tim2 pwm periods
 
     // start stop buttons setup
     init_exti();  // external interrupts setup
@@ -170,6 +199,9 @@ int main(void) {
 
     // PWM setup
     tim2_PWM();  // pwm signal loop
+    pwm_init();  // dithered duties, DMA burst into the CCRs
+    motor_profile_select(0);  // PWM frequency for the default motor
+    protection_init();  // e-stop and overcurrent into the TIM1 break input
 
     // DMA setup
     tim17_DMA();
@@ -219,6 +251,88 @@ void update_display_field(char *updated_string) {
 	LCD_DrawString(cursor_pos_col, cursor_pos_row, BLACK, WHITE, updated_string, font_size, 0);
 }
 
+/*
+ * redraw the values entered so far, used when coming back from another page
+ */
+void draw_entered_values() {
+	char value[8];
+
+	sprintf(value, "%05.2f", motor_des_voltage);
+	LCD_DrawString(far_left_pos, 0, BLACK, WHITE, value, font_size, 0);
+	sprintf(value, "%05.0f", motor_des_speed);
+	LCD_DrawString(far_left_pos, row_inc, BLACK, WHITE, value, font_size, 0);
+	sprintf(value, "%05.0f", motor_max_speed);
+	LCD_DrawString(far_left_pos, row_inc * 2, BLACK, WHITE, value, font_size, 0);
+}
+
+/*
+ * diagnostics page: measurements plus the live motor model and the speed
+ * loop gains scheduled from it.  Labels only need drawing on page entry
+ */
+void draw_diagnostics(bool labels) {
+	const int value_col = 160;
+	char value[12];
+	motor_diag_t diag;
+
+	if(labels) {
+		LCD_DrawString(0, 0, BLACK, WHITE, "DIAGNOSTICS", font_size, 0);
+		LCD_DrawString(0, 16*1, BLACK, WHITE, "Tach lo/hi mV", font_size, 0);
+		LCD_DrawString(0, 16*2, BLACK, WHITE, "Bus voltage", font_size, 0);
+		LCD_DrawString(0, 16*3, BLACK, WHITE, "Output voltage", font_size, 0);
+		LCD_DrawString(0, 16*4, BLACK, WHITE, "Motor current", font_size, 0);
+		LCD_DrawString(0, 16*5, BLACK, WHITE, "Motor RPM", font_size, 0);
+		LCD_DrawString(0, 16*6, BLACK, WHITE, "MCU temp/VDDA", font_size, 0);
+		LCD_DrawString(0, 16*7, BLACK, WHITE, "Model RPM per A", font_size, 0);
+		LCD_DrawString(0, 16*8, BLACK, WHITE, "Model tau (s)", font_size, 0);
+		LCD_DrawString(0, 16*9, BLACK, WHITE, "Speed Kp", font_size, 0);
+		LCD_DrawString(0, 16*10, BLACK, WHITE, "Speed Ki", font_size, 0);
+		LCD_DrawString(0, 16*11, BLACK, WHITE, "Profile (1-9)", font_size, 0);
+		LCD_DrawString(0, 16*12, BLACK, WHITE, "PWM kHz/counts", font_size, 0);
+	}
+
+	// edge thresholds the tach level detector has calibrated itself to
+	tach_levels_t levels;
+	tach_levels(&levels);
+	if(levels.valid) {
+		sprintf(value, "%4lu/%-4lu", (unsigned long)(levels.falling * 3300UL / 4096),
+				(unsigned long)(levels.rising * 3300UL / 4096));
+		LCD_DrawString(value_col, 16*1, BLACK, WHITE, value, font_size, 0);
+	}
+	else {
+		LCD_DrawString(value_col, 16*1, BLACK, WHITE, "     --- ", font_size, 0);
+	}
+
+	sprintf(value, "%8.2f", bus_voltage);
+	LCD_DrawString(value_col, 16*2, BLACK, WHITE, value, font_size, 0);
+	sprintf(value, "%8.2f", converter_output_voltage());
+	LCD_DrawString(value_col, 16*3, BLACK, WHITE, value, font_size, 0);
+	sprintf(value, "%8.3f", motor_current());
+	LCD_DrawString(value_col, 16*4, BLACK, WHITE, value, font_size, 0);
+	sprintf(value, "%8.0f", live_speed_reading);
+	LCD_DrawString(value_col, 16*5, BLACK, WHITE, value, font_size, 0);
+	sprintf(value, "%4.0fC %4.2fV", adc_temperature(), adc_vdda());
+	LCD_DrawString(value_col, 16*6, BLACK, WHITE, value, font_size, 0);
+
+	motor_control_diagnostics(&diag);
+	if(diag.model_valid) {
+		sprintf(value, "%8.0f", diag.rpm_per_a);
+		LCD_DrawString(value_col, 16*7, BLACK, WHITE, value, font_size, 0);
+		sprintf(value, "%8.3f", diag.tau_s);
+		LCD_DrawString(value_col, 16*8, BLACK, WHITE, value, font_size, 0);
+	}
+	else {
+		LCD_DrawString(value_col, 16*7, BLACK, WHITE, "     ---", font_size, 0);
+		LCD_DrawString(value_col, 16*8, BLACK, WHITE, "     ---", font_size, 0);
+	}
+	sprintf(value, "%8.4f", diag.speed_kp);
+	LCD_DrawString(value_col, 16*9, BLACK, WHITE, value, font_size, 0);
+	sprintf(value, "%8.4f", diag.speed_ki);
+	LCD_DrawString(value_col, 16*10, BLACK, WHITE, value, font_size, 0);
+	LCD_DrawString(value_col, 16*11, BLACK, WHITE, motor_profile_current()->name, font_size, 0);
+	sprintf(value, "%4lu/%-5lu", (unsigned long)(pwm_frequency() / 1000), (unsigned long)pwm_resolution());
+	LCD_DrawString(value_col, 16*12, BLACK, WHITE, value, font_size, 0);
+}
+
 void draw_cursor() {
 	LCD_DrawLine(cursor_pos_col, cursor_pos_row + font_size + 1, cursor_pos_col + font_size / 2, cursor_pos_row + font_size + 1, BLACK);
 }
@@ -239,10 +353,13 @@ void process_keyPress(char key) {
 	 * speed
 	 */
 	/* A-D effects for now:
-	 * A: left arrow
-	 * B: right arrow
-	 * C: start motor
-	 * D: stop motor
+	 * A: up arrow
+	 * B: down arrow (on the bottom row: diagnostics page)
+	 * C: left arrow (on the diagnostics page: reverse the motor)
+	 * D: right arrow (at the far right: cycle coast/dynamic/plug braking;
+	 *    on the diagnostics page with the motor stopped: auto-tune the
+	 *    speed loop at the desired speed, once pressed again to confirm)
+	 * *: start/stop motor
 	 */
 
 	void process_num() {
@@ -253,6 +370,41 @@ void process_keyPress(char key) {
 		process_num_triggered = true;
 	}
 
+	// any key but a second 'D' cancels a pending auto-tune
+	bool tune_confirmed = tune_armed;
+	tune_armed = false;
+
+	if(diag_page && key != '*') {
+		// only start/stop, leaving the page, reversing ('C'), picking a
+		// motor profile (digit keys) and the bridge mode ('#') work on the
+		// diagnostics page, the last two only with the motor stopped.
+		// There is no cursor here, so reversing can't be an overshoot
+		if(key == 'A' || key == 'B') {
+			page_change_pending = true;
+		}
+		else if(key == 'C') {
+			motor_fsm_post(MOTOR_EV_REVERSE);
+		}
+		else if(key == 'D' && motor_fsm_state() == MOTOR_IDLE && motor_des_speed > 0) {
+			// relay auto-tune around the entered speed, '*' aborts it
+			if(tune_confirmed) {
+				motor_control_autotune(motor_des_speed);
+				motor_fsm_post(MOTOR_EV_START);
+			}
+			else {
+				tune_armed = true;
+			}
+		}
+		else if(key >= '1' && key <= '9' && motor_fsm_state() == MOTOR_IDLE) {
+			motor_profile_select(key - '1');
+		}
+		else if(key == '#' && motor_fsm_state() == MOTOR_IDLE) {
+			pwm_bridge_mode(pwm_bridge_get_mode() == BRIDGE_SIGN_MAGNITUDE
+					? BRIDGE_LOCKED_ANTIPHASE : BRIDGE_SIGN_MAGNITUDE);
+		}
+		return;
+	}
+
 	switch(key) {
 	case 'A':  // up arrow
 		if(cursor_pos_row > top_field_pos) {
@@ -265,6 +417,9 @@ void process_keyPress(char key) {
 			cursor_pos_row_old = cursor_pos_row;
 			cursor_pos_row += row_inc;
 		}
+		else {
+			page_change_pending = true;
+		}
 		break;
 	case 'C':  // left arrow
 		if(cursor_pos_col > far_left_pos) {
@@ -282,6 +437,13 @@ void process_keyPress(char key) {
 			cursor_pos_col_old = cursor_pos_col;
 			cursor_pos_col += font_size / 2;
 		}
+		else {
+			switch(motor_fsm_brake_mode()) {
+			case BRAKE_COAST:   motor_fsm_set_brake_mode(BRAKE_DYNAMIC); break;
+			case BRAKE_DYNAMIC: motor_fsm_set_brake_mode(BRAKE_PLUG);    break;
+			default:            motor_fsm_set_brake_mode(BRAKE_COAST);   break;
+			}
+		}
 		if(cursor_pos_row == 0 && cursor_pos_col == far_left_pos + (font_size / 2) * 2) {
 			cursor_pos_col += font_size / 2;
 			keypresses[2] = '.';
@@ -320,16 +482,7 @@ void process_keyPress(char key) {
 		}
 		break;
 	case '*':
-		if(motor_running || pwm_enable) {
-			motor_running = false;
-			pwm_enable = false;
-		}
-		else {
-			if(!voltage_too_high) {
-				pwm_enable = true;
-				motor_running = true;
-			}
-		}
+		motor_fsm_post(MOTOR_EV_TOGGLE);
 		break;
 	case '0':
 		process_num();
@@ -468,103 +621,49 @@ void init_spi1() {
 //uint32_t volume = 2400;
 
 
-//============================================================================
-// setup_adc()
-//============================================================================
-void setup_adc(void) {
-    RCC->AHBENR |= RCC_AHBENR_GPIOAEN;
-    GPIOA->MODER |= 0x300;
-    RCC->APB2ENR |= RCC_APB2ENR_ADC1EN;
-    RCC->CR2 |= RCC_CR2_HSI14ON;
-    while(!(RCC->CR2 & RCC_CR2_HSI14RDY));
-    ADC1->CR |= ADC_CR_ADEN;
-    while(!(ADC1->ISR & ADC_ISR_ADRDY));
-
-    ADC1->CHSELR = 0;
-    ADC1->CHSELR |= 1 << 4;
-}
-
-
-// hz to rpm = hz * 60
-/*
- * flip flop variable
- * when signal goes high -> set flipflop to 1
- * when signal goes low -> set flipflop to 0
- * have a counter that starts from 0 when flip flop goes high and ends when flipflop goes high again
- * each counter increment is 1/1000 s
- */
 //============================================================================
 // init_tim3()
+// TIM3 counts TIM2 trigger pulses (one per PWM period, at the OC1REF edge)
+// and fires TIM3_TRGO every CONV_ADC_DECIMATION periods, so the ADC and
+// everything processed after it stay locked to the PWM.
 //============================================================================
 void init_tim3(void) {
     RCC->APB1ENR |= RCC_APB1ENR_TIM3EN;
-//    // 10 hz sampling rate
-//    TIM2->PSC = 47999;
-//    TIM2->ARR = 99;
-    // 1000 hz sampling rate
-	TIM3->PSC = 799;
-	TIM3->ARR = 9;
-    TIM3->DIER |= TIM_DIER_UIE;
+	TIM3->PSC = 0;
+	TIM3->ARR = CONV_ADC_DECIMATION - 1;
+	// external clock mode 1 (SMS = 111) from ITR1 = TIM2_TRGO
+	TIM3->SMCR |= TIM_SMCR_TS_0;
+	TIM3->SMCR |= TIM_SMCR_SMS;
+	// update event as TRGO
+	TIM3->CR2 |= TIM_CR2_MMS_1;
+	// the decimation changes with the PWM frequency; preload it so a
+	// shorter count can't be skipped past
+	TIM3->CR1 |= TIM_CR1_ARPE;
     TIM3->CR1 |= TIM_CR1_CEN;
-    NVIC->ISER[0] |= 0xffffffff;
 }
 
 //============================================================================
-// Variables for boxcar averaging.
+// adc_block()
+// Runs the loops once per ADC block, on the average of its scans; the
+// current loop on the decimated current, whenever there is a new one.
 //============================================================================
-#define BCSIZE 1
-float bcsum = 0;
-float boxcar[BCSIZE];
-int bcn = 0;
-int flipflop = 0;
-float speed_counter = 0;
-
-
-//============================================================================
-// Timer 3 ISR
-//============================================================================
-void TIM3_IRQHandler(){
-    TIM3->SR = ~TIM_SR_UIF;
-    ADC1->CR |= ADC_CR_ADSTART;
-    while(!(ADC1->ISR & ADC_ISR_EOC));
-
-    float live_speed_reading_voltage = 3.3 * (ADC1->DR) / 4096;
-
-    speed_counter += 1.0;
-    if(live_speed_reading_voltage > 0.3) {
-    	if(flipflop == 0) {
-    		// do speed calc
-
-			bcsum -= boxcar[bcn];
-			boxcar[bcn] = (1.0 / (speed_counter / 1000.0)) * 60.0;
-			bcsum += boxcar[bcn];
-
-			bcn += 1;
-			if (bcn >= BCSIZE) {
-				motor_feedback = bcsum / BCSIZE;
-				//live_speed_reading = bcsum / BCSIZE;
-				bcn = 0;
-			}
-
-    		// speed_reading / 1000 -> number of instances high in 1000 hz
-    		// 1 / (speed_reading / 1000) > hz
-    		// hz * 60 = rpm
-    		// live_speed_reading = (1.0 / (speed_counter / 1000.0)) * 60; // rpm
-
-    		speed_counter = 0.0;
-    	}
-    	flipflop = 1;
-    }
-    else {
-    	if(speed_counter > 1000) {
-    		motor_feedback = 0;
-    		live_speed_reading = 0;
-    	}
-    	flipflop = 0;
-    }
-
-
-
+void adc_block(const adc_block_t *block) {
+	converter_update(adc_mean(&block->ch[ADC_CH_BUS]), adc_mean(&block->ch[ADC_CH_VOUT]));
+	tach_level(&block->ch[ADC_CH_TACH]);
+	tach_update();
+	motor_feedback = tach_rpm();
+	uint16_t current;
+	if (adc_decimated(ADC_CH_CURRENT, &current))
+		motor_control_update(current, motor_feedback);
+
+	// all four compare values change in the same PWM period
+	pwm_duties_t duties;
+	converter_duties(&duties);
+	duties.bridge = motor_control_bridge_duty();
+	duties.bridge_short = motor_control_bridge_short();
+	pwm_commit(&duties);
+
+	motor_fsm_update(motor_feedback);
 }
 
 
@@ -582,33 +681,44 @@ void spi1_enable_dma(void) {
 
 void tim2_PWM(void) {
     RCC -> AHBENR |= RCC_AHBENR_GPIOAEN;
-    //Pinout layout: PA1-PA3
-    GPIOA -> MODER &= ~0x000000FC;
-    GPIOA -> MODER |= 0x000000A8;
+    //Pinout layout: PA2 boost, PA3 buck (the H-bridge is on TIM1, pwm.c)
+    GPIOA -> MODER &= ~0x000000F0;
+    GPIOA -> MODER |= 0x000000A0;
 
     //Come back to the AFR and what it does
-    GPIOA -> AFR[0] &= ~0x0000FFF0;
-    GPIOA -> AFR[0] |= 0x00002220;
+    GPIOA -> AFR[0] &= ~0x0000FF00;
+    GPIOA -> AFR[0] |= 0x00002200;
 
-    //Scaling the timer; Currently set to 100 kHz
+    //Scaling the timer; power-up frequency only, the motor profile picks
+    //the frequency through pwm_configure()
     RCC -> APB1ENR |= RCC_APB1ENR_TIM2EN;
-    TIM2 -> PSC = 1;  // 7
-    TIM2 -> ARR = 99;  // 9
-
-    TIM2 -> CCMR1 |= TIM_CCMR1_OC2M_2 | TIM_CCMR1_OC2M_1;
-    TIM2 -> CCMR2 |= TIM_CCMR2_OC3M_2 | TIM_CCMR2_OC3M_1;
-    TIM2 -> CCMR2 |= TIM_CCMR2_OC4M_2 | TIM_CCMR2_OC4M_1;
+    // center-aligned: counts up to ARR and back, two ARRs per period
+    TIM2 -> CR1 |= TIM_CR1_CMS_0;
+    TIM2 -> PSC = 0;
+    TIM2 -> ARR = PWM_CLOCK_HZ / (2 * CONV_PWM_HZ);
+
+    // channel 1 has no pin; its OC1REF (PWM mode 1, CCR1 = 1) rises at the
+    // valley, the middle of the H-bridge pulse, and is sent out as TRGO to
+    // trigger the ADC via TIM3 and start TIM1 in step.  pwm.c moves the
+    // edge ahead to allow for the ADC's scan
+    TIM2 -> CCMR1 |= TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1 | TIM_CCMR1_OC1PE;
+    TIM2 -> CR2 |= TIM_CR2_MMS_2;
+    TIM2 -> CCR1 = 1;
+    // boost and buck in PWM mode 2: their pulses are centred on the peak
+    // and the H-bridge pulse on the valley, so the edges are staggered
+    TIM2 -> CCMR2 |= TIM_CCMR2_OC3M;
+    TIM2 -> CCMR2 |= TIM_CCMR2_OC4M;
 
     //Enable Output
-    //TIM2 -> CCER |= TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E;
+    //TIM2 -> CCER |= TIM_CCER_CC3E | TIM_CCER_CC4E;
 
-    //Enable TIM2 Counter
+    //Enable TIM2 Counter.  It keeps running while the motor is stopped
+    //since it also paces the ADC
     TIM2 -> CR1 |= TIM_CR1_CEN;
 
     // Logic to determine duty cycle (variables temporary)
-    TIM2 -> CCR2 = 0; //H Bridge
-	TIM2 -> CCR3 = 0; //Boost
-	TIM2 -> CCR4 = 0; //Buck
+	TIM2 -> CCR3 = TIM2 -> ARR + 1; //Boost (mode 2, off)
+	TIM2 -> CCR4 = TIM2 -> ARR + 1; //Buck (mode 2, off)
 
 }
 
@@ -639,6 +749,7 @@ void setup_tim7() {
 void TIM7_IRQHandler(){
     TIM7->SR = ~TIM_SR_UIF;
     // Remember to acknowledge the interrupt here!
+    keypad_ms++;  // 48 MHz / 4800 / 10: once a millisecond
     int rows = read_rows();
     update_history(col, rows);
     col = (col + 1) & 3;
@@ -657,20 +768,32 @@ void SysTick_Handler() {
 		initial_startup = false;
 	}
 
-	char buffer[5];
+	if(page_change_pending) {
+		diag_page = !diag_page;
+		LCD_Clear(WHITE);
+		if(diag_page) {
+			draw_diagnostics(true);
+		}
+		else {
+			init_display_fields(data_fields);
+			draw_entered_values();
+		}
+		page_change_pending = false;
+	}
 
-	// live speed rpm
-	sprintf(buffer, "%5.0f", live_speed_reading);
-//
-	LCD_DrawString((num_table_cols - 1) * col_inc, (num_table_rows - 1) * row_inc, BLACK, WHITE, buffer, font_size, 0);
+	char buffer[6];
 
-	if(motor_running) {
-		LCD_DrawString(0, 240-16*1, BLACK, WHITE, "MOTOR RUNNING", font_size, 0);
+	if(diag_page) {
+		draw_diagnostics(false);
 	}
 	else {
-		LCD_DrawString(0, 240-16*1, BLACK, WHITE, "MOTOR STOPPED", font_size, 0);
+		// live speed rpm
+		sprintf(buffer, "%5.0f", live_speed_reading);
+		LCD_DrawString((num_table_cols - 1) * col_inc, (num_table_rows - 1) * row_inc, BLACK, WHITE, buffer, font_size, 0);
 	}
 
+	LCD_DrawString(0, 240-16*1, BLACK, WHITE, motor_fsm_state_name(), font_size, 0);
+
 
 	if(enter_key_pressed) {
 		if(cursor_pos_row == 0) {
@@ -710,62 +833,76 @@ void SysTick_Handler() {
 		}
 		process_num_triggered = false;
 	}
-	if(pwm_enable == true) {
-		TIM2 -> CCER |= TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E;
-
-		// Enable TIM2 Counter
-		TIM2 -> CR1 |= TIM_CR1_CEN;
+	bus_voltage = converter_bus_voltage();
+	bool voltage_too_high = motor_des_voltage > MOTOR_MAX_OUTPUT_VOLTAGE;
 
-		LCD_DrawString(0, 240-16*1, BLACK, WHITE, "MOTOR RUNNING ", font_size, 0);
+	if (voltage_too_high) {
+		LCD_DrawString(0, 240-16*2, BLACK, WHITE, "VOLTAGE TOO HIGH", font_size, 0);
 	}
-	else {
-		TIM2 -> CCER &= ~(TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E);
-
-		// Disable TIM2 Counter
-		TIM2 -> CR1 &= ~TIM_CR1_CEN;
-
-//		live_speed_reading = 0;
-//		motor_feedback = 0;
-
-		LCD_DrawString(0, 240-16*1, BLACK, WHITE, "MOTOR STOPPING", font_size, 0);
+	else if (bus_voltage < BUS_MIN_VOLTAGE || motor_fsm_fault_code() == MOTOR_FAULT_SUPPLY) {
+		LCD_DrawString(0, 240-16*2, BLACK, WHITE, "SUPPLY TOO LOW  ", font_size, 0);
 	}
-
-	float BV = 9;
-	float d_buck = 0;  // pin 17 on stm32f091rct6
-	float d_boost = 0;  // pin 16 on stm32f091rct6
-	float d_Hbridge = 0;  // pin 15 on stm32f091rct6
-
-	if (motor_des_voltage <= BV) {
-		d_buck = 100 * (motor_des_voltage / BV);
-		d_boost = 0;
-		d_Hbridge = 100 * (motor_des_speed / motor_max_speed);
-		LCD_DrawString(0, 240-16*2, BLACK, WHITE, "                   ", font_size, 0);
-		voltage_too_high = false;
+	else if (motor_fsm_fault_code() == MOTOR_FAULT_PRECHARGE) {
+		LCD_DrawString(0, 240-16*2, BLACK, WHITE, "PRECHARGE FAILED", font_size, 0);
+	}
+	else if (motor_fsm_fault_code() == MOTOR_FAULT_ESTOP) {
+		LCD_DrawString(0, 240-16*2, BLACK, WHITE, "E-STOP          ", font_size, 0);
 	}
-	else if (motor_des_voltage <= 24)
-	{
-		d_buck = 100;
-		d_boost = 100 * (1 - (BV / motor_des_voltage));
-		d_Hbridge = 100 * (motor_des_speed / motor_max_speed);
-		LCD_DrawString(0, 240-16*2, BLACK, WHITE, "                  ", font_size, 0);
-		voltage_too_high = false;
+	else if (motor_fsm_fault_code() == MOTOR_FAULT_OVERCURRENT) {
+		LCD_DrawString(0, 240-16*2, BLACK, WHITE, "OVERCURRENT TRIP", font_size, 0);
 	}
 	else {
-		voltage_too_high = true;
-		d_buck = 0;
-		d_boost = 0;
-		d_Hbridge = 0;
-		LCD_DrawString(0, 240-16*2, BLACK, WHITE, "VOLTAGE TOO HIGH", font_size, 0);
+		LCD_DrawString(0, 240-16*2, BLACK, WHITE, "                ", font_size, 0);
 	}
 
+	// direction, stop mode and bridge mode share the message line
+	const char *stop_name = "COAST";
+	if(motor_fsm_brake_mode() == BRAKE_DYNAMIC) {
+		stop_name = "DYN  ";
+	}
+	else if(motor_fsm_brake_mode() == BRAKE_PLUG) {
+		stop_name = "PLUG ";
+	}
+	LCD_DrawString(192, 240-16*2, BLACK, WHITE, motor_control_direction() ? "FWD" : "REV", font_size, 0);
+	LCD_DrawString(232, 240-16*2, BLACK, WHITE, stop_name, font_size, 0);
+	LCD_DrawString(280, 240-16*2, BLACK, WHITE,
+			pwm_bridge_get_mode() == BRIDGE_SIGN_MAGNITUDE ? "SM " : "LAP", font_size, 0);
+
+	// buck (CCR4) and boost (CCR3) are set by the output voltage loop in
+	// converter_update(), H-bridge duty (TIM1) by the current loop under the
+	// speed loop.  Output enables and the speed ramp belong to the state
+	// machine; this only hands over the setpoints
+	converter_set_target(voltage_too_high ? 0 : motor_des_voltage);
+
+	float speed_target = motor_des_speed;
+	if(speed_target > motor_max_speed) {
+		speed_target = motor_max_speed;
+	}
+	motor_fsm_set_setpoint(motor_des_voltage, speed_target);
 
-	//Setting the duty cycle (Reloads at 9; CCR2 at 5 = ~50%)
-	TIM2 -> CCR2 = d_Hbridge; //H Bridge
-	TIM2 -> CCR3 = d_boost; //Boost
-	TIM2 -> CCR4 = d_buck; //Buck
+	// auto-tune status shares the motor status line
+	if(tune_armed) {
+		LCD_DrawString(160, 240-16*1, BLACK, WHITE, "D TO TUNE? ", font_size, 0);
+	}
+	else switch(motor_control_autotune_state()) {
+	case AUTOTUNE_RUNNING:
+		LCD_DrawString(160, 240-16*1, BLACK, WHITE, "AUTO-TUNING", font_size, 0);
+		break;
+	case AUTOTUNE_DONE:
+		LCD_DrawString(160, 240-16*1, BLACK, WHITE, "TUNE DONE  ", font_size, 0);
+		break;
+	case AUTOTUNE_FAILED:
+		LCD_DrawString(160, 240-16*1, BLACK, WHITE, "TUNE FAILED", font_size, 0);
+		break;
+	default:
+		LCD_DrawString(160, 240-16*1, BLACK, WHITE, "           ", font_size, 0);
+		break;
+	}
 
-	erase_cursor();
-	draw_cursor();
+	if(!diag_page) {
+		erase_cursor();
+		draw_cursor();
+	}
 }
 
 /**
@@ -787,28 +924,27 @@ void init_systick() {
 // EXTI Interrupt handler for pins 4-15
 // acknowledge interrupt on pins 8,9
 void EXTI4_15_IRQHandler() {
-    //EXTI->PR |= EXTI_PR_PR8 | EXTI_PR_PR9;
-	EXTI->PR |= EXTI_PR_PR9;
+    // PC8 is unmasked too, so it has to be acknowledged or the ISR re-enters
+    bool pc9_edge = EXTI->PR & EXTI_PR_PR9;
+    EXTI->PR = EXTI_PR_PR8 | EXTI_PR_PR9;
+    if(!pc9_edge) {
+        return;
+    }
 
 //    if(GPIOC->IDR & (0x1 << 8)) {  // start motor
 //        motor_running = true;
 //        TIM2 -> CCER |= TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E;  // start pwm signal coming out
 //        TIM2 -> CR1 |= TIM_CR1_CEN;
 //    }
-    if(GPIOC->IDR & (0x1 << 9)) {  // stop motor
-        if(motor_running) {
-        	motor_running = false;
-        	pwm_enable = false;
-			TIM2 -> CCER &= ~(TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E);  // stop pwm signal coming out
-			TIM2 -> CR1 &= ~TIM_CR1_CEN;
-        }
-        else {
-        	motor_running = true;
-        	pwm_enable = true;
-			TIM2 -> CCER |= TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E;  // start pwm signal coming out
-			TIM2 -> CR1 |= TIM_CR1_CEN;
-        }
-        mysleep(50);
+    // only posts the event; the e-stop doesn't come through here at all.
+    // PC9 interrupts on both edges: a press is a rising edge after the pin
+    // has been quiet for BUTTON_DEBOUNCE_MS, so contact bounce on the press
+    // and on the release is dropped
+    uint32_t now = keypad_ms;
+    bool quiet = now - button_last_ms >= BUTTON_DEBOUNCE_MS;
+    button_last_ms = now;
+    if((GPIOC->IDR & (0x1 << 9)) && quiet) {  // start/stop motor
+        motor_fsm_post(MOTOR_EV_TOGGLE);
     }
 }
 
@@ -819,6 +955,7 @@ void init_exti() {
     // enable the exti interrupt for pins 8-9
     SYSCFG->EXTICR[3] |= SYSCFG_EXTICR3_EXTI8_PC | SYSCFG_EXTICR3_EXTI9_PC;
     EXTI->RTSR |= EXTI_RTSR_TR8 | EXTI_RTSR_TR9;
+    EXTI->FTSR |= EXTI_FTSR_TR9;  // the release too, for the debounce
     EXTI->IMR |= EXTI_IMR_MR8 | EXTI_IMR_MR9;
     NVIC->ISER[0] |= 0x00000080;
 }
@@ -834,20 +971,21 @@ void tim17_DMA(void) {
 
 void setup_dma(void) {
     RCC->AHBENR |= RCC_AHBENR_DMA1EN;
-    DMA1_Channel1 -> CCR &= ~DMA_CCR_EN; //Disabling for edits
-    //ADC1 -> CFGR1 |= ADC_CFGR1_DMAEN;
-    DMA1_Channel1 -> CPAR = (uint32_t) &live_speed_reading; //Address of the peripheral register
-    DMA1_Channel1 -> CMAR = (uint32_t) &motor_feedback; //Address of memory register
-    DMA1_Channel1 -> CNDTR = 1; //Size of the array being stored
-    DMA1_Channel1 -> CCR |= DMA_CCR_DIR; //Copy from memory to peripheral
-    DMA1_Channel1 -> CCR |= DMA_CCR_MINC; //Incrementing every transfer
-    DMA1_Channel1 -> CCR |= DMA_CCR_PINC; //Only used for memory to memory
-    DMA1_Channel1 -> CCR |= DMA_CCR_MEM2MEM;
-    DMA1_Channel1 -> CCR &= ~0x00000F00;  // clear Msize and psize
-    DMA1_Channel1 -> CCR |= 0x00000A00;  // 32 bits on msize and psize (1010)
-    DMA1_Channel1 -> CCR |= DMA_CCR_CIRC; //Enabling circular mode
+    // channel 1 belongs to the ADC, 2 and 5 to the TIM2 and TIM1 bursts,
+    // 3 to SPI1_TX
+    DMA1_Channel7 -> CCR &= ~DMA_CCR_EN; //Disabling for edits
+    DMA1_Channel7 -> CPAR = (uint32_t) &live_speed_reading; //Address of the peripheral register
+    DMA1_Channel7 -> CMAR = (uint32_t) &motor_feedback; //Address of memory register
+    DMA1_Channel7 -> CNDTR = 1; //Size of the array being stored
+    DMA1_Channel7 -> CCR |= DMA_CCR_DIR; //Copy from memory to peripheral
+    DMA1_Channel7 -> CCR |= DMA_CCR_MINC; //Incrementing every transfer
+    DMA1_Channel7 -> CCR |= DMA_CCR_PINC; //Only used for memory to memory
+    DMA1_Channel7 -> CCR |= DMA_CCR_MEM2MEM;
+    DMA1_Channel7 -> CCR &= ~0x00000F00;  // clear Msize and psize
+    DMA1_Channel7 -> CCR |= 0x00000A00;  // 32 bits on msize and psize (1010)
+    DMA1_Channel7 -> CCR |= DMA_CCR_CIRC; //Enabling circular mode
 }
 
 void enable_dma(void) {
-	DMA1_Channel1 -> CCR |= DMA_CCR_EN; //Enabling the DMA
+	DMA1_Channel7 -> CCR |= DMA_CCR_EN; //Enabling the DMA
 }
@@ -0,0 +1,244 @@
+//============================================================================
+// motor_control.c: Cascaded speed and current loops for the H-bridge.
+//
+// The speed loop (speed_loop.c) commands a motor current and the current
+// loop turns that into H-bridge duty (TIM1 CH1/CH2 and their complementary
+// outputs, see pwm.c).  Both run from the ADC interrupt, so the current
+// samples they use are PWM-synchronous.  Active braking reuses the current
+// loop (plugging) or chops the low-side short against the measured current
+// (dynamic braking).
+//============================================================================
+
+#include "stm32f0xx.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "control.h"
+#include "autotune.h"
+#include "motor_id.h"
+#include "speed_loop.h"
+#include "motor_control.h"
+#include "pwm.h"
+
+// H-bridge duty is handled in Q12 (4096 = 100%) and scaled onto ARR last
+#define DUTY_ONE 4096
+
+// current loop: Q12 duty per mA of error (Q8)
+#define CURRENT_KP 64
+#define CURRENT_KI 16
+
+static speed_loop_t speed;
+static pi_ctrl_t current_pi = { CURRENT_KP, CURRENT_KI, 0, 0, DUTY_ONE };
+
+static volatile int32_t speed_ref_rpm = 0;
+static volatile bool control_on = false;
+
+static volatile brake_mode_t brake_mode = BRAKE_NONE;
+static volatile int32_t brake_limit_ma = 0;
+static volatile bool forward = true;
+
+static int32_t current_ref_ma = 0;
+static volatile int32_t current_ma = 0;
+static volatile int32_t bridge_duty = 0;  // Q12
+static int speed_div = 0;
+
+// Online identification of current -> speed, the plant the speed loop
+// drives through the current loop.  The speed loop gains are rescheduled
+// relative to the model seen when they were last set (at boot or by the
+// auto-tuner): kp scales with 1/K to hold the crossover and ki/kp with
+// 1/tau to keep the PI zero on the mechanical pole.
+#define SCHEDULE_DECIMATION 10   // 10 Hz
+#define SCHEDULE_MIN_SCALE 0.25f
+#define SCHEDULE_MAX_SCALE 4.0f
+
+static motor_id_t motor_id;
+static bool id_started = false;
+static int32_t current_acc = 0;
+static int sched_div = 0;
+
+static bool sched_ref_valid = false;
+static float ref_gain, ref_tau, ref_kp, ref_ki;
+
+static volatile bool model_valid = false;
+static volatile float model_gain = 0;
+static volatile float model_tau = 0;
+
+//============================================================================
+// H-bridge direction and braking
+//============================================================================
+// Plugging drives against this on its own.
+void motor_control_set_direction(bool fwd)
+{
+    forward = fwd;
+}
+
+bool motor_control_direction(void)
+{
+    return forward;
+}
+
+// Select how the bridge is driven.  The current limit applies to the
+// dynamic and plug modes.
+void motor_control_brake(brake_mode_t mode, int32_t current_limit_ma)
+{
+    brake_limit_ma = current_limit_ma;
+    pi_reset(&current_pi, 0);
+    bridge_duty = 0;
+    brake_mode = mode;
+}
+
+// H-bridge duty as a signed Q16 fraction of the period, for pwm_commit()
+int32_t motor_control_bridge_duty(void)
+{
+    bool fwd = brake_mode == BRAKE_PLUG ? !forward : forward;
+    return fwd ? bridge_duty << 4 : -(bridge_duty << 4);
+}
+
+// Both low sides on instead of any duty, for pwm_commit().  Zero duty is
+// only a short in sign-magnitude.
+bool motor_control_bridge_short(void)
+{
+    return brake_mode == BRAKE_DYNAMIC;
+}
+
+void motor_control_set_speed(float rpm)
+{
+    speed_ref_rpm = rpm;
+}
+
+void motor_control_enable(bool enable)
+{
+    control_on = enable;
+}
+
+//============================================================================
+// motor_control_init()
+// Call before the ADC starts calling motor_control_update().
+//============================================================================
+void motor_control_init(void)
+{
+    speed_loop_init(&speed);
+}
+
+float motor_current(void)
+{
+    return current_ma / 1000.0f;
+}
+
+// Start a relay experiment around `rpm`, after settling there to find the
+// holding current.  The loop must be enabled for it to run.
+void motor_control_autotune(float rpm)
+{
+    speed_loop_autotune(&speed, rpm);
+}
+
+autotune_state_t motor_control_autotune_state(void)
+{
+    return speed.tuner.state;
+}
+
+void motor_control_diagnostics(motor_diag_t *diag)
+{
+    diag->model_valid = model_valid;
+    diag->rpm_per_a = model_gain * 1000;
+    diag->tau_s = model_tau;
+    diag->speed_kp = (float)speed.pi.kp / (1 << PI_SHIFT);
+    diag->speed_ki = (float)speed.pi.ki / (1 << PI_SHIFT);
+}
+
+static float clamp_scale(float x)
+{
+    if (x < SCHEDULE_MIN_SCALE)
+        return SCHEDULE_MIN_SCALE;
+    if (x > SCHEDULE_MAX_SCALE)
+        return SCHEDULE_MAX_SCALE;
+    return x;
+}
+
+// Called at SPEED_LOOP_HZ with the mean current over the last period.
+static void identify_and_schedule(int32_t speed_rpm, int32_t mean_ma)
+{
+    float gain, tau;
+
+    if (!id_started) {
+        motor_id_init(&motor_id);
+        id_started = true;
+    }
+    motor_id_update(&motor_id, speed_rpm, mean_ma);
+
+    if (++sched_div < SCHEDULE_DECIMATION)
+        return;
+    sched_div = 0;
+
+    model_valid = motor_id_model(&motor_id, 1.0f / SPEED_LOOP_HZ, &gain, &tau);
+    if (!model_valid)
+        return;
+    model_gain = gain;
+    model_tau = tau;
+
+    if (!sched_ref_valid) {
+        ref_gain = gain;
+        ref_tau = tau;
+        ref_kp = speed.pi.kp;
+        ref_ki = speed.pi.ki;
+        sched_ref_valid = true;
+        return;
+    }
+
+    if (speed.tuning)
+        return;
+
+    float kp_scale = clamp_scale(ref_gain / gain);
+    float ti_scale = clamp_scale(ref_tau / tau);
+    speed.pi.kp = ref_kp * kp_scale;
+    speed.pi.ki = ref_ki * kp_scale * ti_scale;
+}
+
+//============================================================================
+// motor_control_update()
+// Called from the ADC interrupt with each decimated current reading (16
+// bits of full scale), once every CURRENT_LOOP_DECIMATION blocks.
+//============================================================================
+void motor_control_update(uint16_t current, int32_t speed_rpm)
+{
+    current_ma = ((uint32_t)current * CURRENT_FULL_SCALE_MA) >> 16;
+
+    if (brake_mode == BRAKE_DYNAMIC) {
+        // the bridge is committed as a low-side short in either bridge
+        // mode; release it for a millisecond whenever the current is over
+        // the limit
+        bridge_duty = 0;
+        pwm_bridge_enable(current_ma < brake_limit_ma);
+        return;
+    }
+    if (brake_mode == BRAKE_PLUG) {
+        int32_t duty = pi_update(&current_pi, brake_limit_ma - current_ma, 0);
+        bridge_duty = duty;
+        return;
+    }
+
+    if (!control_on) {
+        speed_loop_reset(&speed);
+        pi_reset(&current_pi, 0);
+        current_ref_ma = 0;
+        speed_div = 0;
+        current_acc = 0;
+        id_started = false;
+        bridge_duty = 0;
+        return;
+    }
+
+    current_acc += current_ma;
+    if (++speed_div >= SPEED_LOOP_DECIMATION) {
+        int32_t mean_ma = current_acc / SPEED_LOOP_DECIMATION;
+        speed_div = 0;
+        current_acc = 0;
+        identify_and_schedule(speed_rpm, mean_ma);
+        current_ref_ma = speed_loop_step(&speed, speed_ref_rpm, speed_rpm, mean_ma);
+        if (speed.new_gains) {
+            speed.new_gains = false;
+            sched_ref_valid = false;  // new baseline for gain scheduling
+        }
+    }
+
+    bridge_duty = pi_update(&current_pi, current_ref_ma - current_ma, 0);
+}
@@ -0,0 +1,362 @@
+//============================================================================
+// motor_fsm.c: Motor supervisory state machine.
+//
+// The keypad, the start/stop button and SysTick only post events; the state
+// machine consumes them from the ADC interrupt.  TIM2 output enables are
+// written once, on a transition, so nothing else races to change them.
+//
+//   IDLE --start--> PRECHARGE --Vout ok--> RAMP_UP --at speed--> RUNNING
+//     ^                                                             |
+//     |                                                      stop/reverse
+//     |                                                             v
+//     +--stopped-- BRAKING <--speed ref at 0-- RAMP_DOWN <--(coast)-+
+//                     ^                                             |
+//                     +-----------(dynamic or plug braking)---------+
+//
+//   BRAKING --stopped, reverse pending--> PRECHARGE in the other direction
+//   plug braking hands over to dynamic braking before the motor reaches
+//   zero, so it can't drive it backwards
+//   any running state --fault--> FAULT --toggle/stop--> IDLE
+//   any state --break input trip--> FAULT, cleared only once the e-stop is
+//   released and the current is back under the trip level
+//============================================================================
+
+#include "stm32f0xx.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "motor_fsm.h"
+#include "converter.h"
+#include "motor_control.h"
+#include "protection.h"
+
+#define FSM_DECIMATION (CONV_LOOP_HZ / MOTOR_FSM_HZ)
+
+// speed reference slew
+#define RAMP_RPM_PER_S 2000
+#define RAMP_STEP (RAMP_RPM_PER_S / MOTOR_FSM_HZ)
+
+// precharge is done once the output is within 10% (or 0.5V) of setpoint
+#define PRECHARGE_TIMEOUT_S 1
+#define PRECHARGE_TOLERANCE 0.1f
+#define PRECHARGE_MIN_TOLERANCE 0.5f
+
+// treat the motor as stopped below this
+#define STOPPED_RPM 50
+
+// The tach has a single channel, so it reads a motor plugged into reverse
+// as still turning forwards, and near zero its edges are a period or more
+// apart.  Plugging therefore ends well above zero: below PLUG_HANDOFF_RPM,
+// or once the deceleration over the last tick would reach zero within
+// PLUG_LEAD_TICKS.  Dynamic braking, which can't reverse the motor, takes
+// it the rest of the way.
+#define PLUG_HANDOFF_RPM 300
+#define PLUG_LEAD_TICKS 3
+
+// Each stop mode has its own current and time limit.  Active braking that
+// runs out of time falls back to coasting for up to the coast time.
+typedef struct
+{
+    int32_t current_limit_ma;
+    uint32_t time_limit_ms;
+} brake_profile_t;
+
+static const brake_profile_t brake_profiles[] = {
+    [BRAKE_COAST]   = { 0,    5000 },
+    [BRAKE_DYNAMIC] = { 3000, 2000 },
+    [BRAKE_PLUG]    = { 1500, 1000 },
+};
+
+#define BRIDGE_OUTPUTS 0x1
+#define CONVERTER_OUTPUTS 0x2
+
+static const char *state_names[] = {
+    "MOTOR STOPPED ",
+    "PRECHARGING   ",
+    "RAMPING UP    ",
+    "MOTOR RUNNING ",
+    "RAMPING DOWN  ",
+    "MOTOR STOPPING",
+    "MOTOR FAULT   ",
+};
+
+static volatile uint32_t pending = 0;
+static volatile motor_fault_t fault_code = MOTOR_FAULT_NONE;
+static volatile motor_state_t state = MOTOR_IDLE;
+
+static volatile float target_volts = 0;
+static volatile int32_t target_rpm = 0;
+static volatile brake_mode_t stop_mode = BRAKE_COAST;
+static brake_mode_t active_brake = BRAKE_COAST;
+static bool reverse_pending = false;
+static int32_t speed_ref = 0;
+static int32_t brake_last_rpm = 0;  // speed one tick ago, while braking
+static uint32_t state_ticks = 0;
+static int fsm_div = 0;
+
+void motor_fsm_post(motor_event_t ev)
+{
+    __disable_irq();
+    pending |= 1 << ev;
+    __enable_irq();
+}
+
+void motor_fsm_fault(motor_fault_t fault)
+{
+    fault_code = fault;
+    motor_fsm_post(MOTOR_EV_FAULT);
+}
+
+void motor_fsm_set_setpoint(float volts, float rpm)
+{
+    target_volts = volts;
+    target_rpm = rpm;
+}
+
+void motor_fsm_set_brake_mode(brake_mode_t mode)
+{
+    if (mode == BRAKE_COAST || mode == BRAKE_DYNAMIC || mode == BRAKE_PLUG)
+        stop_mode = mode;
+}
+
+brake_mode_t motor_fsm_brake_mode(void)
+{
+    return stop_mode;
+}
+
+motor_state_t motor_fsm_state(void)
+{
+    return state;
+}
+
+motor_fault_t motor_fsm_fault_code(void)
+{
+    return fault_code;
+}
+
+const char *motor_fsm_state_name(void)
+{
+    return state_names[state];
+}
+
+static void set_outputs(uint32_t enables)
+{
+    const uint32_t converter_ccer = TIM_CCER_CC3E | TIM_CCER_CC4E;
+
+    if (enables & CONVERTER_OUTPUTS)
+        TIM2->CCER |= converter_ccer;
+    else
+        TIM2->CCER &= ~converter_ccer;
+    pwm_bridge_enable(enables & BRIDGE_OUTPUTS);
+}
+
+static void start_brake(brake_mode_t mode)
+{
+    active_brake = mode;
+    motor_control_brake(mode, brake_profiles[mode].current_limit_ma);
+    if (mode == BRAKE_PLUG) {
+        // plugging drives the bridge backwards from the converter
+        set_outputs(CONVERTER_OUTPUTS | BRIDGE_OUTPUTS);
+    } else {
+        converter_enable(false);
+        set_outputs(0);
+    }
+}
+
+// all peripheral side effects of a state change live here
+static void enter(motor_state_t next, int32_t speed_rpm)
+{
+    state = next;
+    state_ticks = 0;
+
+    switch (next) {
+    case MOTOR_IDLE:
+    case MOTOR_FAULT:
+        reverse_pending = false;
+        motor_control_enable(false);
+        motor_control_brake(BRAKE_NONE, 0);
+        converter_enable(false);
+        set_outputs(0);
+        break;
+    case MOTOR_PRECHARGE:
+        converter_enable(true);
+        set_outputs(CONVERTER_OUTPUTS);
+        break;
+    case MOTOR_RAMP_UP:
+        speed_ref = speed_rpm;  // pick up a motor that is still spinning
+        motor_control_set_speed(speed_ref);
+        motor_control_enable(true);
+        set_outputs(CONVERTER_OUTPUTS | BRIDGE_OUTPUTS);
+        break;
+    case MOTOR_RUNNING:
+    case MOTOR_RAMP_DOWN:
+        break;
+    case MOTOR_BRAKING:
+        motor_control_enable(false);
+        brake_last_rpm = speed_rpm;
+        start_brake(stop_mode);
+        break;
+    }
+}
+
+static bool running_state(void)
+{
+    return state == MOTOR_PRECHARGE || state == MOTOR_RAMP_UP ||
+           state == MOTOR_RUNNING || state == MOTOR_RAMP_DOWN;
+}
+
+// move speed_ref one step toward goal, true once it is there
+static bool ramp_toward(int32_t goal)
+{
+    if (speed_ref < goal - RAMP_STEP)
+        speed_ref += RAMP_STEP;
+    else if (speed_ref > goal + RAMP_STEP)
+        speed_ref -= RAMP_STEP;
+    else
+        speed_ref = goal;
+    motor_control_set_speed(speed_ref);
+    return speed_ref == goal;
+}
+
+static bool setpoint_ok(void)
+{
+    return target_volts <= MOTOR_MAX_OUTPUT_VOLTAGE;
+}
+
+static bool precharged(void)
+{
+    float tolerance = target_volts * PRECHARGE_TOLERANCE;
+    if (tolerance < PRECHARGE_MIN_TOLERANCE)
+        tolerance = PRECHARGE_MIN_TOLERANCE;
+    float error = converter_output_voltage() - target_volts;
+    return error < tolerance && error > -tolerance;
+}
+
+static void handle_event(motor_event_t ev, int32_t speed_rpm)
+{
+    switch (ev) {
+    case MOTOR_EV_FAULT:
+        enter(MOTOR_FAULT, speed_rpm);  // latched until stop/toggle
+        break;
+    case MOTOR_EV_TOGGLE:
+        if (state == MOTOR_IDLE)
+            handle_event(MOTOR_EV_START, speed_rpm);
+        else
+            handle_event(MOTOR_EV_STOP, speed_rpm);
+        break;
+    case MOTOR_EV_START:
+        if (state == MOTOR_IDLE && setpoint_ok() &&
+            converter_bus_voltage() >= BUS_MIN_VOLTAGE)
+            enter(MOTOR_PRECHARGE, speed_rpm);
+        break;
+    case MOTOR_EV_STOP:
+        if (state == MOTOR_FAULT) {
+            if (!protection_clear())
+                break;  // e-stop still open or current still high
+            fault_code = MOTOR_FAULT_NONE;
+            enter(MOTOR_IDLE, speed_rpm);
+        } else if (state == MOTOR_PRECHARGE) {
+            enter(MOTOR_IDLE, speed_rpm);
+        } else if (state == MOTOR_RAMP_UP || state == MOTOR_RUNNING) {
+            enter(stop_mode == BRAKE_COAST ? MOTOR_RAMP_DOWN : MOTOR_BRAKING, speed_rpm);
+        }
+        break;
+    case MOTOR_EV_REVERSE:
+        if (state == MOTOR_IDLE) {
+            motor_control_set_direction(!motor_control_direction());
+        } else if (state == MOTOR_RAMP_UP || state == MOTOR_RUNNING) {
+            reverse_pending = true;
+            handle_event(MOTOR_EV_STOP, speed_rpm);
+        }
+        break;
+    }
+}
+
+//============================================================================
+// motor_fsm_update()
+// Called from the ADC interrupt at CONV_LOOP_HZ; steps at MOTOR_FSM_HZ.
+//============================================================================
+void motor_fsm_update(int32_t speed_rpm)
+{
+    if (++fsm_div < FSM_DECIMATION)
+        return;
+    fsm_div = 0;
+
+    __disable_irq();
+    uint32_t events = pending;
+    pending = 0;
+    __enable_irq();
+
+    // a fault wins the tick: a stop or toggle posted alongside it would
+    // clear the latch before anyone saw it, so the rest are dropped
+    if (events & (1 << MOTOR_EV_FAULT)) {
+        handle_event(MOTOR_EV_FAULT, speed_rpm);
+    } else {
+        for (int ev = MOTOR_EV_START; ev < MOTOR_EV_FAULT; ev++) {
+            if (events & (1 << ev))
+                handle_event(ev, speed_rpm);
+        }
+    }
+
+    if (running_state()) {
+        if (!setpoint_ok()) {
+            fault_code = MOTOR_FAULT_SETPOINT;
+            enter(MOTOR_FAULT, speed_rpm);
+        } else if (converter_bus_voltage() < BUS_MIN_VOLTAGE) {
+            fault_code = MOTOR_FAULT_SUPPLY;
+            enter(MOTOR_FAULT, speed_rpm);
+        }
+    }
+
+    state_ticks++;
+
+    switch (state) {
+    case MOTOR_PRECHARGE:
+        if (precharged()) {
+            enter(MOTOR_RAMP_UP, speed_rpm);
+        } else if (state_ticks > PRECHARGE_TIMEOUT_S * MOTOR_FSM_HZ) {
+            fault_code = MOTOR_FAULT_PRECHARGE;
+            enter(MOTOR_FAULT, speed_rpm);
+        }
+        break;
+    case MOTOR_RAMP_UP:
+        if (ramp_toward(target_rpm))
+            enter(MOTOR_RUNNING, speed_rpm);
+        break;
+    case MOTOR_RUNNING:
+        ramp_toward(target_rpm);  // setpoint edits are slewed too
+        break;
+    case MOTOR_RAMP_DOWN:
+        if (ramp_toward(0))
+            enter(MOTOR_BRAKING, speed_rpm);
+        break;
+    case MOTOR_BRAKING: {
+        int32_t decel = brake_last_rpm - speed_rpm;
+        brake_last_rpm = speed_rpm;
+
+        if (active_brake == BRAKE_PLUG &&
+            (speed_rpm < PLUG_HANDOFF_RPM || speed_rpm < decel * PLUG_LEAD_TICKS)) {
+            start_brake(BRAKE_DYNAMIC);
+            state_ticks = 0;
+        } else if (speed_rpm < STOPPED_RPM) {
+            motor_control_brake(BRAKE_NONE, 0);
+            if (reverse_pending) {
+                reverse_pending = false;
+                motor_control_set_direction(!motor_control_direction());
+                enter(MOTOR_PRECHARGE, speed_rpm);
+            } else {
+                enter(MOTOR_IDLE, speed_rpm);
+            }
+        } else if (state_ticks > brake_profiles[active_brake].time_limit_ms * MOTOR_FSM_HZ / 1000) {
+            if (active_brake != BRAKE_COAST) {
+                start_brake(BRAKE_COAST);
+                state_ticks = 0;
+            } else {
+                enter(MOTOR_IDLE, speed_rpm);  // still turning, don't reverse into it
+            }
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
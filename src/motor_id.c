@@ -0,0 +1,143 @@
+//============================================================================
+// motor_id.c: Recursive least squares identification of a first-order
+//             motor model, speed[k] = a * speed[k-1] + b * current[k-1].
+//
+// The input is the motor current, not the bridge duty: the speed loop
+// commands current, so this is the plant it sees through the current loop.
+// b / (1 - a) is the mechanics' rpm per mA and the pole is J / B, neither
+// of which moves with the converter's output voltage.
+//
+// Everything is 32-bit fixed point with 64-bit intermediates:
+//   regressors  Q15, speed as a fraction of 32768 rpm and current of
+//               ID_CURRENT_SCALE_MA
+//   parameters  Q16
+//   covariance  Q24
+// An exponential forgetting factor lets the estimate follow the motor as it
+// heats up or the load changes.  The covariance is bounded so it can't blow
+// up while the motor sits at constant speed with nothing to learn from.
+//============================================================================
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "motor_id.h"
+
+#define Q16 (1 << 16)
+#define Q24 (1 << 24)
+
+// Current regressor full scale: a power of two just above the speed
+// loop's CURRENT_LIMIT_MA.  Scaled to the shunt's range instead, the
+// current regressor is so small next to the speed that the covariance
+// would need more than P_MAX to learn the pole.
+#define ID_CURRENT_SCALE_MA 2048
+#define ID_CURRENT_SHIFT 4  // mA to Q15 of ID_CURRENT_SCALE_MA
+
+// lambda = 0.995, a memory of about 200 samples (2 s at the speed loop rate)
+#define LAMBDA_Q24 16693248
+#define INV_LAMBDA_Q16 65865
+
+#define P_INIT (100 * Q24 / 2)
+#define P_MAX (100 * Q24)
+
+// ignore samples until the filter has seen enough to be meaningful
+#define MIN_SAMPLES 50
+
+void motor_id_init(motor_id_t *id)
+{
+    id->theta[0] = Q16 / 2;
+    id->theta[1] = 0;
+    id->P[0][0] = P_INIT;
+    id->P[0][1] = 0;
+    id->P[1][0] = 0;
+    id->P[1][1] = P_INIT;
+    id->y_prev = 0;
+    id->samples = 0;
+}
+
+static int32_t clamp_q15(int32_t v)
+{
+    if (v > 32767)
+        return 32767;
+    if (v < -32768)
+        return -32768;
+    return v;
+}
+
+//============================================================================
+// motor_id_update()
+// One RLS step with the speed measured now and the mean current since the
+// previous call.  That current is the model's current[k-1]: it acted over
+// the period that ends with this speed.
+//============================================================================
+void motor_id_update(motor_id_t *id, int32_t speed_rpm, int32_t current_ma)
+{
+    int32_t phi[2];
+    int32_t Pphi[2];
+    int32_t k[2];
+    int64_t acc;
+    int i, j;
+
+    phi[0] = clamp_q15(id->y_prev);
+    phi[1] = clamp_q15(current_ma << ID_CURRENT_SHIFT);
+    id->y_prev = speed_rpm;
+
+    // P * phi, Q24
+    for (i = 0; i < 2; i++) {
+        acc = (int64_t)id->P[i][0] * phi[0] + (int64_t)id->P[i][1] * phi[1];
+        Pphi[i] = acc >> 15;
+    }
+
+    // lambda + phi' * P * phi, Q24
+    acc = (int64_t)phi[0] * Pphi[0] + (int64_t)phi[1] * Pphi[1];
+    int64_t denom = LAMBDA_Q24 + (acc >> 15);
+
+    // prediction error, Q16
+    acc = (int64_t)phi[0] * id->theta[0] + (int64_t)phi[1] * id->theta[1];
+    int32_t err = (clamp_q15(speed_rpm) << 1) - (int32_t)(acc >> 15);
+
+    // gain, Q16
+    for (i = 0; i < 2; i++)
+        k[i] = ((int64_t)Pphi[i] << 16) / denom;
+
+    // round rather than truncate, a plain shift floors every small
+    // negative correction and drags the estimate down over time
+    for (i = 0; i < 2; i++)
+        id->theta[i] += ((int64_t)k[i] * err + (1 << 15)) >> 16;
+
+    // P = (P - k * (P phi)') / lambda, kept symmetric
+    for (i = 0; i < 2; i++) {
+        for (j = i; j < 2; j++) {
+            acc = id->P[i][j] - (((int64_t)k[i] * Pphi[j]) >> 16);
+            acc = (acc * INV_LAMBDA_Q16) >> 16;
+            if (acc > P_MAX)
+                acc = P_MAX;
+            if (acc < -P_MAX)
+                acc = -P_MAX;
+            id->P[i][j] = acc;
+            id->P[j][i] = acc;
+        }
+    }
+
+    id->samples++;
+}
+
+//============================================================================
+// motor_id_model()
+// Convert the discrete estimate into a steady-state gain (rpm per mA) and
+// a time constant.  Returns false while the estimate isn't a stable,
+// positive-gain first-order system.
+//============================================================================
+bool motor_id_model(const motor_id_t *id, float ts, float *rpm_per_ma, float *tau_s)
+{
+    float a = (float)id->theta[0] / Q16;
+    float b = (float)id->theta[1] / Q16;
+
+    if (id->samples < MIN_SAMPLES || a <= 0.0f || a >= 0.9999f || b <= 0.0f)
+        return false;
+
+    // b is in (32768 rpm) per ID_CURRENT_SCALE_MA; steady state is
+    // b / (1 - a)
+    *rpm_per_ma = 32768.0f / ID_CURRENT_SCALE_MA * b / (1.0f - a);
+    *tau_s = -ts / logf(a);
+    return true;
+}
@@ -0,0 +1,48 @@
+//============================================================================
+// motor_profile.c: Per-motor drive settings.
+//
+// The H-bridge (TIM1) runs locked to the converter's TIM2, so a profile's
+// PWM frequency applies to both.  Lower frequencies trade ripple for finer
+// duty resolution and lower switching loss.
+//============================================================================
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pwm.h"
+#include "converter.h"
+#include "motor_profile.h"
+
+static const motor_profile_t profiles[] = {
+    { "DEFAULT ", CONV_PWM_HZ, 100 },   // small brushed motor, 200 counts
+    { "LOW LOSS", 80000,       500 },   // larger motor, 600 counts
+    { "FINE    ", 40000,       1000 },  // slow precise runs, 1200 counts
+};
+
+#define PROFILE_COUNT ((int)(sizeof(profiles) / sizeof(profiles[0])))
+
+static int current = 0;
+
+int motor_profile_count(void)
+{
+    return PROFILE_COUNT;
+}
+
+//============================================================================
+// motor_profile_select()
+// Apply a profile.  Only call this with the motor stopped.  Returns false
+// and keeps the current profile if the index or its PWM setting is bad.
+//============================================================================
+bool motor_profile_select(int index)
+{
+    if (index < 0 || index >= PROFILE_COUNT)
+        return false;
+    if (pwm_configure(profiles[index].pwm_hz, profiles[index].pwm_min_steps) == 0)
+        return false;
+    current = index;
+    return true;
+}
+
+const motor_profile_t *motor_profile_current(void)
+{
+    return &profiles[current];
+}
@@ -0,0 +1,44 @@
+//============================================================================
+// observer.c: Load-torque disturbance observer.
+//
+// Inverting the mechanical model  J dw/dt = Kt i - B w - T_load  gives
+//
+//     T_load / Kt = i - (J / Kt) dw/dt - (B / Kt) w
+//
+// i is the measured motor current and dw/dt the difference of successive
+// speed samples.  The raw estimate is noisy (it differentiates the tach),
+// so it goes through a first-order low-pass, which is the Q-filter of a
+// classic disturbance observer and sets how fast it reacts to a load step.
+//============================================================================
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "observer.h"
+
+void load_observer_reset(load_observer_t *ob)
+{
+    ob->speed_prev = 0;
+    ob->estimate = 0;
+    ob->primed = false;
+}
+
+//============================================================================
+// load_observer_update()
+// Call at a fixed rate_hz.  Returns the filtered load current in mA.
+//============================================================================
+int32_t load_observer_update(load_observer_t *ob, int32_t current_ma, int32_t speed_rpm, int32_t rate_hz)
+{
+    if (!ob->primed) {
+        ob->speed_prev = speed_rpm;
+        ob->primed = true;
+        return 0;
+    }
+
+    int32_t accel = (speed_rpm - ob->speed_prev) * rate_hz;  // rpm/s
+    ob->speed_prev = speed_rpm;
+
+    int32_t load = (current_ma << 8) - ob->ma_per_rpm_s * accel - ob->ma_per_rpm * speed_rpm;
+    ob->estimate += (load - ob->estimate) >> ob->filter_shift;
+
+    return ob->estimate >> 8;
+}
@@ -0,0 +1,114 @@
+//============================================================================
+// protection.c: Hardware e-stop and overcurrent trip on the TIM1 break input.
+//
+// The e-stop line on PB12 (TIM1_BKIN, AF2) and the COMP1 output are ORed
+// onto the TIM1 break input.  Either going high clears MOE asynchronously,
+// with no software in the path: OSSI holds all four bridge gates at their
+// idle-low level within the comparator and gate delays.  AOE is left off,
+// so the bridge stays off until the fault has been cleared and the state
+// machine enables it again.
+//
+// The e-stop is a normally closed contact to ground with the pin pulled up,
+// so a broken wire trips the bridge as well as the button does.
+//
+// The break interrupt only reports: it records the cause and raises a
+// motor_fsm fault, which shuts the converter down and latches until the
+// start/stop button clears it.
+//============================================================================
+
+#include "stm32f0xx.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "motor_fsm.h"
+#include "protection.h"
+
+#ifndef COMP_CSR_COMP1INSEL_VREFINT
+#define COMP_CSR_COMP1INSEL_VREFINT (COMP_CSR_COMP1INSEL_1 | COMP_CSR_COMP1INSEL_0)
+#endif
+#ifndef COMP_CSR_COMP1OUTSEL_TIM1BRK
+#define COMP_CSR_COMP1OUTSEL_TIM1BRK COMP_CSR_COMP1OUTSEL_0
+#endif
+
+static volatile trip_cause_t cause = TRIP_NONE;
+
+//============================================================================
+// protection_init()
+// Call after pwm_init(), which sets up the rest of TIM1's BDTR.
+//============================================================================
+void protection_init(void)
+{
+    RCC->AHBENR |= RCC_AHBENR_GPIOAEN | RCC_AHBENR_GPIOBEN;
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGCOMPEN;
+
+    // PB12 AF2 (TIM1_BKIN) with pull-up
+    GPIOB->MODER = (GPIOB->MODER & ~GPIO_MODER_MODER12) | GPIO_MODER_MODER12_1;
+    GPIOB->AFR[1] = (GPIOB->AFR[1] & ~0x000F0000) | 0x00020000;
+    GPIOB->PUPDR = (GPIOB->PUPDR & ~GPIO_PUPDR_PUPDR12) | GPIO_PUPDR_PUPDR12_0;
+
+    // PA1 analog, COMP1 non-inverting input
+    GPIOA->MODER |= GPIO_MODER_MODER1;
+
+    // high-speed mode, medium hysteresis against shunt ringing at the
+    // switching edges, output straight to the TIM1 break input
+    COMP->CSR = (COMP->CSR & ~0xFFFF)
+              | COMP_CSR_COMP1INSEL_VREFINT
+              | COMP_CSR_COMP1OUTSEL_TIM1BRK
+              | COMP_CSR_COMP1HYST_1
+              | COMP_CSR_COMP1EN;
+
+    // active high; a trip that is already present at power-up is caught
+    // by the interrupt as soon as it is enabled
+    TIM1->BDTR |= TIM_BDTR_BKP | TIM_BDTR_BKE;
+    TIM1->SR = ~TIM_SR_BIF;
+    TIM1->DIER |= TIM_DIER_BIE;
+    NVIC->ISER[0] |= 1 << TIM1_BRK_UP_TRG_COM_IRQn;
+}
+
+trip_cause_t protection_cause(void)
+{
+    return cause;
+}
+
+// true while either break source is still asserted
+bool protection_active(void)
+{
+    return (GPIOB->IDR & GPIO_IDR_12) || (COMP->CSR & COMP_CSR_COMP1OUT);
+}
+
+//============================================================================
+// protection_clear()
+// Re-arms the break interrupt once both sources have gone away.  MOE stays
+// clear; the caller turns the bridge back on when it next needs it.
+//============================================================================
+bool protection_clear(void)
+{
+    if (protection_active())
+        return false;
+    cause = TRIP_NONE;
+    TIM1->SR = ~TIM_SR_BIF;
+    TIM1->DIER |= TIM_DIER_BIE;
+    return true;
+}
+
+//============================================================================
+// TIM1_BRK_UP_TRG_COM_IRQHandler()
+// The outputs are already off by the time this runs.  BIF keeps coming
+// back while the source is held, so the interrupt stays masked until
+// protection_clear().
+//============================================================================
+void TIM1_BRK_UP_TRG_COM_IRQHandler(void)
+{
+    if (!(TIM1->SR & TIM_SR_BIF))
+        return;
+    TIM1->DIER &= ~TIM_DIER_BIE;
+    TIM1->SR = ~TIM_SR_BIF;
+
+    // an overcurrent pulse may be gone by now; the e-stop is held
+    if (GPIOB->IDR & GPIO_IDR_12) {
+        cause = TRIP_ESTOP;
+        motor_fsm_fault(MOTOR_FAULT_ESTOP);
+    } else {
+        cause = TRIP_OVERCURRENT;
+        motor_fsm_fault(MOTOR_FAULT_OVERCURRENT);
+    }
+}
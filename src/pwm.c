@@ -0,0 +1,429 @@
+//============================================================================
+// pwm.c: TIM2 converter and TIM1 H-bridge PWM with sigma-delta dithering
+// and atomic updates.
+//
+// TIM2 counts up and down (center-aligned mode 1), so every period has an
+// update event at the valley and another at the peak.  The prescaler,
+// auto-reload and all four compare registers are preloaded and written only
+// by a TIM2 DMA burst (DCR/DMAR) on each update event, so every half period
+// sees one consistent set of duties and buck and boost can never be half
+// updated.  Since the period travels in the same burst, a frequency change
+// lands together with the rescaled duties.
+//
+// The burst reads from a pattern of DITHER_LEN frames, one per half period.
+// Each channel's column is a first-order sigma-delta modulation of the
+// fractional part of its compare value: the integer part is written every
+// half period and the fraction is spread as +1 counts, which pushes the
+// error up towards the switching frequency where the output filters remove
+// it.  Every column sums to the exact duty over one pass of the pattern.
+//
+// TIM1 drives the H-bridge: CH1/CH1N are leg A (PA8/PB13), CH2/CH2N leg B
+// (PA9/PB14), complementary with dead time, gated by MOE.  It is started
+// by TIM2's trigger and runs from the same clock with the same PSC/ARR,
+// which travel in its own DMA burst (DMA1 Channel 5, TIM1_UP), so the two
+// timers stay locked through frequency changes.  The converter switches
+// (PWM mode 2) are centred on the peak.  Leg A runs in PWM mode 1, and
+// leg B's mode follows the bridge mode:
+//   sign-magnitude     PWM mode 1.  One leg switches, centred on the
+//                      valley in either direction, and the other holds
+//                      its low side on; the low sides act as synchronous
+//                      rectifiers.  So the bridge and the converter only
+//                      conduct together when their duties add up to more
+//                      than one period, and then only for the excess.
+//   locked-antiphase   PWM mode 2.  Leg B is the exact complement of leg A
+//                      (equal compare values), so 50% is standstill.  One
+//                      high side is always on, so there is no staggering.
+// A low-side short (bridge_short) is the sign-magnitude zero in either
+// mode: in locked-antiphase zero is 50/50 switching, not a short.
+//
+// TIM2 OC1REF (PWM mode 1) goes out as TRGO to trigger the ADC through
+// TIM3.  The motor current is sampled a fixed ADC_DELAY_TICKS after the
+// trigger, so CCR1 sets the rising edge that much ahead of a valley or a
+// peak (whichever fits in the down-count).  Both are the middle of a bridge
+// on- or off-time, where the motor current equals its average, and the
+// middle of a converter pulse or gap, as far from every switching edge as
+// the period allows.
+//
+// pwm_commit() builds into a back buffer; the DMA transfer-complete
+// interrupt swaps it in between two passes, so a pattern is never played
+// while it is being rewritten.
+//============================================================================
+
+#include "stm32f0xx.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "pwm.h"
+#include "converter.h"
+#include "adc.h"
+#include "protection.h"
+
+// not in this version of the device header (RM0091, DMA1 request mapping)
+#ifndef DMA_RMPCR1_CH2_TIM2_UP
+#define DMA_RMPCR1_CH2_TIM2_UP ((uint32_t)0x00000050)
+#endif
+#define DMA_RMPCR1_CH2_FIELD ((uint32_t)0x000000F0)
+#ifndef DMA_RMPCR1_CH5_TIM1_UP
+#define DMA_RMPCR1_CH5_TIM1_UP ((uint32_t)0x00040000)
+#endif
+#define DMA_RMPCR1_CH5_FIELD ((uint32_t)0x000F0000)
+
+// Shoot-through margin between each high and low side, in 48 MHz ticks
+// (DTG below 128 is a direct count)
+#define BRIDGE_DEAD_TIME_NS 250
+#define BRIDGE_DTG ((BRIDGE_DEAD_TIME_NS * 48 + 999) / 1000)
+
+// Bursts start at PSC (word offset 10 from CR1): PSC, ARR, RCR, CCR1...
+// TIM2 has no RCR; that write is ignored.  TIM2 goes on to CCR4, TIM1 stops
+// at CCR2.
+#define BURST_BASE 10
+#define BURST_LEN 7
+#define BRIDGE_BURST_LEN 5
+#define COL_PSC 0
+#define COL_ARR 1
+#define COL_RCR 2
+#define COL_CCR1 3
+
+static uint16_t frames[2][DITHER_LEN][BURST_LEN];
+static uint16_t bridge_frames[2][DITHER_LEN][BRIDGE_BURST_LEN];
+static uint32_t built[2][BURST_LEN];  // value each column was built for
+static uint32_t bridge_built[2][BRIDGE_BURST_LEN];
+static volatile uint8_t front = 0;
+static volatile bool back_ready = false;
+
+static uint32_t psc = 0;
+static uint32_t half = 100;  // ARR: counts from valley to peak
+static pwm_duties_t last_duties;
+static volatile uint32_t decimation_pending = 0;
+static uint32_t trigger = 1;  // TIM2 CCR1
+static volatile bridge_mode_t bridge_mode = BRIDGE_SIGN_MAGNITUDE;
+
+static void dma_start(void)
+{
+    DMA1_Channel5->CMAR = (uint32_t)bridge_frames[front];
+    DMA1_Channel5->CNDTR = DITHER_LEN * BRIDGE_BURST_LEN;
+    DMA1_Channel5->CCR |= DMA_CCR_EN;
+    DMA1_Channel2->CMAR = (uint32_t)frames[front];
+    DMA1_Channel2->CNDTR = DITHER_LEN * BURST_LEN;
+    DMA1_Channel2->CCR |= DMA_CCR_EN;
+}
+
+//============================================================================
+// bridge_init()
+// TIM1 in the same center-aligned mode as TIM2, outputs off until
+// pwm_bridge_enable().  Trigger mode on ITR1 (TIM2_TRGO) starts the
+// counter at TIM2's valley, so both count in step from then on.  That
+// needs TIM2's CCR1 still at 1, so this has to finish before the first
+// pattern plays.
+//============================================================================
+static void bridge_init(void)
+{
+    RCC->AHBENR |= RCC_AHBENR_GPIOAEN | RCC_AHBENR_GPIOBEN;
+    RCC->APB2ENR |= RCC_APB2ENR_TIM1EN;
+
+    // PA8, PA9 (CH1, CH2) and PB13, PB14 (CH1N, CH2N), all AF2
+    GPIOA->MODER = (GPIOA->MODER & ~(GPIO_MODER_MODER8 | GPIO_MODER_MODER9))
+                 | GPIO_MODER_MODER8_1 | GPIO_MODER_MODER9_1;
+    GPIOA->AFR[1] = (GPIOA->AFR[1] & ~0x000000FF) | 0x00000022;
+    GPIOB->MODER = (GPIOB->MODER & ~(GPIO_MODER_MODER13 | GPIO_MODER_MODER14))
+                 | GPIO_MODER_MODER13_1 | GPIO_MODER_MODER14_1;
+    GPIOB->AFR[1] = (GPIOB->AFR[1] & ~0x0FF00000) | 0x02200000;
+
+    TIM1->CR1 = TIM_CR1_CMS_0 | TIM_CR1_ARPE;
+    TIM1->PSC = psc;
+    TIM1->ARR = half;
+    TIM1->CCR1 = 0;
+    TIM1->CCR2 = 0;
+    TIM1->EGR = TIM_EGR_UG;
+
+    // both legs PWM mode 1 for sign-magnitude, compares preloaded
+    TIM1->CCMR1 = TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1 | TIM_CCMR1_OC1PE
+                | TIM_CCMR1_OC2M_2 | TIM_CCMR1_OC2M_1 | TIM_CCMR1_OC2PE;
+    TIM1->CCER = TIM_CCER_CC1E | TIM_CCER_CC1NE | TIM_CCER_CC2E | TIM_CCER_CC2NE;
+
+    // With MOE clear the outputs go to their idle level (OISx = 0, all
+    // four gates low), not high impedance
+    TIM1->BDTR = TIM_BDTR_OSSI | TIM_BDTR_OSSR | BRIDGE_DTG;
+
+    // DMA burst on each update event, like TIM2
+    TIM1->DCR = ((BRIDGE_BURST_LEN - 1) << 8) | BURST_BASE;
+    TIM1->DIER |= TIM_DIER_UDE;
+
+    TIM1->SMCR = TIM_SMCR_TS_0 | TIM_SMCR_SMS_2 | TIM_SMCR_SMS_1;
+    while (!(TIM1->CR1 & TIM_CR1_CEN));  // at most one PWM period
+}
+
+// TIM2 CCR1 for a trigger that lands the current sample on a valley or a
+// peak: 1 puts the edge on the valley itself
+static uint32_t trigger_compare(void)
+{
+    return 1 + (ADC_DELAY_TICKS(ADC_CH_CURRENT) / (psc + 1)) % half;
+}
+
+//============================================================================
+// pwm_init()
+// Call after TIM2 is configured.  Starts with all duties at zero at the
+// frequency TIM2 was set up with.
+//============================================================================
+void pwm_init(void)
+{
+    __disable_irq();
+    psc = TIM2->PSC;
+    half = TIM2->ARR;
+
+    // force a full build on the first commit
+    for (int b = 0; b < 2; b++) {
+        for (int col = 0; col < BURST_LEN; col++)
+            built[b][col] = 0xffffffff;
+        for (int col = 0; col < BRIDGE_BURST_LEN; col++)
+            bridge_built[b][col] = 0xffffffff;
+    }
+
+    bridge_init();
+    trigger = trigger_compare();
+
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+
+    // TIM1 first: its pass has to be finished when TIM2's ends and
+    // triggers the swap
+    DMA1_Channel5->CCR &= ~DMA_CCR_EN;
+    DMA1->RMPCR = (DMA1->RMPCR & ~DMA_RMPCR1_CH5_FIELD) | DMA_RMPCR1_CH5_TIM1_UP;
+    DMA1_Channel5->CPAR = (uint32_t)&TIM1->DMAR;
+    DMA1_Channel5->CCR = DMA_CCR_DIR | DMA_CCR_MINC
+                       | DMA_CCR_MSIZE_0 | DMA_CCR_PSIZE_1
+                       | DMA_CCR_PL;
+
+    DMA1_Channel2->CCR &= ~DMA_CCR_EN;
+    DMA1->RMPCR = (DMA1->RMPCR & ~DMA_RMPCR1_CH2_FIELD) | DMA_RMPCR1_CH2_TIM2_UP;
+    DMA1_Channel2->CPAR = (uint32_t)&TIM2->DMAR;
+    DMA1_Channel2->CCR = DMA_CCR_DIR | DMA_CCR_MINC
+                       | DMA_CCR_MSIZE_0     // 16-bit pattern entries
+                       | DMA_CCR_PSIZE_1     // 32-bit DMAR
+                       | DMA_CCR_PL_1        // ahead of the LCD transfers
+                       | DMA_CCR_TCIE;
+
+    // values written at an update event apply to the whole next half period
+    TIM2->CR1 |= TIM_CR1_ARPE;
+    TIM2->CCMR1 |= TIM_CCMR1_OC1PE;
+    TIM2->CCMR2 |= TIM_CCMR2_OC3PE | TIM_CCMR2_OC4PE;
+    TIM2->DCR = ((BURST_LEN - 1) << 8) | BURST_BASE;
+    TIM2->DIER |= TIM_DIER_UDE;
+
+    pwm_commit(&last_duties);
+    front ^= 1;
+    back_ready = false;
+    dma_start();
+    NVIC_EnableIRQ(DMA1_Ch2_3_DMA2_Ch1_2_IRQn);
+    __enable_irq();
+}
+
+//============================================================================
+// pwm_configure()
+// Switch to the PWM frequency closest to hz that has at least min_steps
+// timer counts per period (up and down), using the smallest prescaler
+// (most resolution) that fits.  hz is rounded to a multiple of
+// CONV_ADC_HZ so the ADC and the control loops keep their rates.  The next
+// pwm_commit() rescales the duties to the new period and both go out in the
+// same update event.  Returns the actual frequency, or 0 (and changes
+// nothing) if hz can't be had at that resolution.
+//============================================================================
+uint32_t pwm_configure(uint32_t hz, uint32_t min_steps)
+{
+    uint32_t decimation = (hz + CONV_ADC_HZ / 2) / CONV_ADC_HZ;
+    if (decimation < 1 || min_steps < 2)
+        return 0;
+    hz = decimation * CONV_ADC_HZ;
+
+    uint32_t ticks = PWM_CLOCK_HZ / hz;
+    uint32_t div = (ticks + 2 * PWM_MAX_STEPS - 1) / (2 * PWM_MAX_STEPS);
+    uint32_t arr = (PWM_CLOCK_HZ / div + hz) / (2 * hz);
+    if (2 * arr < min_steps || arr > PWM_MAX_STEPS || div > 65536)
+        return 0;
+
+    __disable_irq();
+    psc = div - 1;
+    half = arr;
+    trigger = trigger_compare();
+    decimation_pending = decimation;
+    __enable_irq();
+    return pwm_frequency();
+}
+
+uint32_t pwm_frequency(void)
+{
+    return PWM_CLOCK_HZ / ((psc + 1) * 2 * half);
+}
+
+// timer counts per period, before dithering
+uint32_t pwm_resolution(void)
+{
+    return 2 * half;
+}
+
+//============================================================================
+// pwm_bridge_mode()
+// Only while the bridge is off (MOE clear); returns false otherwise.  Leg
+// B's output mode changes straight away, but its compare values only with
+// the next pwm_commit(), and in between they would put out the inverse
+// pulse.
+//============================================================================
+bool pwm_bridge_mode(bridge_mode_t mode)
+{
+    if (TIM1->BDTR & TIM_BDTR_MOE)
+        return false;
+
+    uint32_t ccmr = TIM1->CCMR1 & ~TIM_CCMR1_OC2M;
+    if (mode == BRIDGE_LOCKED_ANTIPHASE)
+        ccmr |= TIM_CCMR1_OC2M;  // PWM mode 2
+    else
+        ccmr |= TIM_CCMR1_OC2M_2 | TIM_CCMR1_OC2M_1;  // PWM mode 1
+    TIM1->CCMR1 = ccmr;
+    bridge_mode = mode;
+    return true;
+}
+
+bridge_mode_t pwm_bridge_get_mode(void)
+{
+    return bridge_mode;
+}
+
+//============================================================================
+// pwm_bridge_enable()
+// Main output enable.  Off puts all four switches off and lets the motor
+// coast; on with bridge_short committed shorts it through the low sides.
+// The break input (protection.c) clears it in hardware,
+// and it can't be set again until protection_clear() has accepted the
+// trip, even once the source has gone away.  BIF covers a trip whose
+// interrupt hasn't run yet: it waits behind the ADC interrupt that calls
+// this.
+//============================================================================
+void pwm_bridge_enable(bool on)
+{
+    if (on) {
+        if (protection_cause() != TRIP_NONE || (TIM1->SR & TIM_SR_BIF))
+            return;
+        TIM1->BDTR |= TIM_BDTR_MOE;
+    } else {
+        TIM1->BDTR &= ~TIM_BDTR_MOE;
+    }
+}
+
+// one column of a pattern: first is the entry in frame 0, stride the
+// frame length
+static void build_column(uint16_t *first, int stride, uint32_t duty)
+{
+    uint32_t base = duty >> DITHER_BITS;
+    uint32_t frac = duty & (DITHER_LEN - 1);
+    uint32_t acc = 0;
+
+    for (int i = 0; i < DITHER_LEN; i++) {
+        acc += frac;
+        first[i * stride] = base + (acc >> DITHER_BITS);
+        acc &= DITHER_LEN - 1;
+    }
+}
+
+// Compare values for a Q16 duty, in 1/DITHER_LEN counts.  Full on and full
+// off need ARR + 1 to avoid a one-count pulse or gap at the turning point.
+static uint32_t centred_on_valley(uint32_t duty)
+{
+    if (duty >= PWM_DUTY_ONE)
+        return (half + 1) << DITHER_BITS;
+    return (duty * half) >> (16 - DITHER_BITS);
+}
+
+static uint32_t centred_on_peak(uint32_t duty)
+{
+    if (duty == 0)
+        return (half + 1) << DITHER_BITS;
+    if (duty >= PWM_DUTY_ONE)
+        return 0;
+    return (half << DITHER_BITS) - ((duty * half) >> (16 - DITHER_BITS));
+}
+
+//============================================================================
+// pwm_commit()
+// Hand over a complete set of duties.  They reach the outputs together at
+// the end of the pattern pass that is playing, within DITHER_LEN / 2
+// periods.
+//============================================================================
+void pwm_commit(const pwm_duties_t *duties)
+{
+    last_duties = *duties;
+
+    // in 1/DITHER_LEN counts
+    uint32_t duty[BURST_LEN];
+    duty[COL_PSC] = psc << DITHER_BITS;
+    duty[COL_ARR] = half << DITHER_BITS;
+    duty[COL_RCR] = 0;
+    duty[COL_CCR1] = trigger << DITHER_BITS;
+    duty[COL_CCR1 + 1] = 0;  // TIM2 CH2 unused since the bridge moved to TIM1
+    duty[COL_CCR1 + 2] = centred_on_peak(duties->boost);
+    duty[COL_CCR1 + 3] = centred_on_peak(duties->buck);
+
+    uint32_t bridge[BRIDGE_BURST_LEN];
+    bridge[COL_PSC] = duty[COL_PSC];
+    bridge[COL_ARR] = duty[COL_ARR];
+    bridge[COL_RCR] = 0;
+    if (duties->bridge_short) {
+        // both low sides on, whatever the mode
+        bridge[COL_CCR1] = centred_on_valley(0);
+        bridge[COL_CCR1 + 1] = bridge_mode == BRIDGE_LOCKED_ANTIPHASE
+                             ? centred_on_peak(0) : centred_on_valley(0);
+    } else if (bridge_mode == BRIDGE_LOCKED_ANTIPHASE) {
+        // leg A at (1 + d) / 2, leg B its complement
+        uint32_t a = (uint32_t)(PWM_DUTY_ONE + duties->bridge) / 2;
+        bridge[COL_CCR1] = centred_on_valley(a);
+        bridge[COL_CCR1 + 1] = bridge[COL_CCR1];
+    } else if (duties->bridge >= 0) {
+        // leg A switches, leg B low side on
+        bridge[COL_CCR1] = centred_on_valley(duties->bridge);
+        bridge[COL_CCR1 + 1] = centred_on_valley(0);
+    } else {
+        // leg B switches, leg A low side on
+        bridge[COL_CCR1] = centred_on_valley(0);
+        bridge[COL_CCR1 + 1] = centred_on_valley(-duties->bridge);
+    }
+
+    // the swap can't happen while the back buffer is half written
+    back_ready = false;
+    int back = front ^ 1;
+
+    // columns that already hold the right duty are left alone
+    for (int col = 0; col < BURST_LEN; col++) {
+        if (duty[col] != built[back][col]) {
+            build_column(&frames[back][0][col], BURST_LEN, duty[col]);
+            built[back][col] = duty[col];
+        }
+    }
+    for (int col = 0; col < BRIDGE_BURST_LEN; col++) {
+        if (bridge[col] != bridge_built[back][col]) {
+            build_column(&bridge_frames[back][0][col], BRIDGE_BURST_LEN, bridge[col]);
+            bridge_built[back][col] = bridge[col];
+        }
+    }
+    back_ready = true;
+}
+
+//============================================================================
+// End of a pattern pass: swap in the newest complete pattern and restart.
+// Has to finish within half a PWM period; if it doesn't, the preloaded
+// duties simply repeat for one more half period.
+//============================================================================
+void DMA1_CH2_3_DMA2_CH1_2_IRQHandler(void)
+{
+    if (DMA1->ISR & DMA_ISR_TCIF2) {
+        DMA1->IFCR = DMA_IFCR_CTCIF2;
+        DMA1_Channel5->CCR &= ~DMA_CCR_EN;
+        DMA1_Channel2->CCR &= ~DMA_CCR_EN;
+        if (back_ready) {
+            front ^= 1;
+            back_ready = false;
+            if (decimation_pending && built[front][COL_ARR] == half << DITHER_BITS) {
+                // keep TIM3 dividing the new PWM rate down to the ADC rate
+                TIM3->ARR = decimation_pending - 1;
+                decimation_pending = 0;
+            }
+        }
+        dma_start();
+    }
+}
@@ -0,0 +1,134 @@
+//============================================================================
+// speed_loop.c: Speed PI with load feedforward and relay auto-tune.
+//
+// Runs at SPEED_LOOP_HZ and returns the current reference for the current
+// loop.  It has no hardware of its own, so the host simulations in test/
+// drive this same code against a motor model.
+//
+// The load observer's estimate is added onto the current reference, so a
+// load step is answered at the current loop instead of waiting for the
+// speed integrator.
+//
+// The relay auto-tune drives the current reference, so the gains it finds
+// are directly in speed loop units (mA per rpm).  First the speed PI holds
+// the setpoint for AUTOTUNE_SETTLE_S, and the mean current over the second
+// half becomes the relay bias.  Switching about the holding current keeps
+// the limit cycle symmetric, which 4d / (pi a) assumes.  The swing is
+// AUTOTUNE_AMPLITUDE_MA, less if that would take the reference outside
+// 0..CURRENT_LIMIT_MA.  The hysteresis only has to cover tach noise; a
+// band near the cycle amplitude moves the cycle off the ultimate point
+// (test/sim_autotune.c).  Tuned gains take the feedforward off with them.
+//============================================================================
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "control.h"
+#include "observer.h"
+#include "autotune.h"
+#include "motor_control.h"
+#include "speed_loop.h"
+
+#define AUTOTUNE_SETTLE_STEPS (AUTOTUNE_SETTLE_S * SPEED_LOOP_HZ)
+
+void speed_loop_init(speed_loop_t *s)
+{
+    pi_init(&s->pi, SPEED_KP, SPEED_KI, 0, CURRENT_LIMIT_MA);
+    s->obs.ma_per_rpm_s = LOAD_MA_PER_RPM_S;
+    s->obs.ma_per_rpm = LOAD_MA_PER_RPM;
+    s->obs.filter_shift = LOAD_FILTER_SHIFT;
+    s->feedforward = USE_LOAD_OBSERVER;
+    s->tuner.state = AUTOTUNE_IDLE;
+    s->tuning = false;
+    s->new_gains = false;
+    speed_loop_reset(s);
+}
+
+//============================================================================
+// speed_loop_reset()
+// With the loop off: clears the integrator and the load estimate, and
+// fails a tune that was running.  Keeps the gains.
+//============================================================================
+void speed_loop_reset(speed_loop_t *s)
+{
+    if (s->tuning) {
+        s->tuner.state = AUTOTUNE_FAILED;  // stopped mid-experiment
+        s->tuning = false;
+    }
+    pi_reset(&s->pi, 0);
+    load_observer_reset(&s->obs);
+    s->load_ff_ma = 0;
+}
+
+// Start a relay experiment around `rpm`, after settling there to find the
+// holding current.
+void speed_loop_autotune(speed_loop_t *s, int32_t rpm)
+{
+    s->tuning = false;
+    s->tune_rpm = rpm;
+    s->tune_settle = AUTOTUNE_SETTLE_STEPS;
+    s->tune_hold_acc = 0;
+    s->tuner.state = AUTOTUNE_RUNNING;
+    s->tuning = true;
+}
+
+// in place of the speed PI while tuning
+static int32_t autotune_speed_step(speed_loop_t *s, int32_t speed_rpm)
+{
+    if (s->tune_settle > 0) {
+        int32_t hold = pi_update(&s->pi, s->tune_rpm - speed_rpm, s->load_ff_ma);
+        if (s->tune_settle <= AUTOTUNE_SETTLE_STEPS / 2)
+            s->tune_hold_acc += hold;
+        if (--s->tune_settle > 0)
+            return hold;
+
+        int32_t bias = s->tune_hold_acc / (AUTOTUNE_SETTLE_STEPS / 2);
+        int32_t d = AUTOTUNE_AMPLITUDE_MA;
+        if (d > bias)
+            d = bias;
+        if (d > CURRENT_LIMIT_MA - bias)
+            d = CURRENT_LIMIT_MA - bias;
+        if (d < AUTOTUNE_MIN_AMPLITUDE_MA) {
+            // no room to swing either side of the holding current
+            s->tuner.state = AUTOTUNE_FAILED;
+            s->tuning = false;
+            return hold;
+        }
+        autotune_start(&s->tuner, s->tune_rpm, bias, d, AUTOTUNE_HYSTERESIS_RPM,
+                       AUTOTUNE_TIMEOUT_S * SPEED_LOOP_HZ);
+    }
+
+    int32_t iref = autotune_step(&s->tuner, speed_rpm);
+
+    if (s->tuner.state == AUTOTUNE_DONE) {
+        s->pi.kp = s->tuner.pi_kp * (1 << PI_SHIFT);
+        s->pi.ki = s->tuner.pi_ki * (1 << PI_SHIFT);
+        pi_reset(&s->pi, iref);
+        // the relay saw the plant without the feedforward, and the gains
+        // have no margin for the lag the observer adds (test/sim_autotune.c)
+        s->feedforward = false;
+        s->new_gains = true;
+        s->tuning = false;
+    } else if (s->tuner.state == AUTOTUNE_FAILED) {
+        pi_reset(&s->pi, iref);
+        s->tuning = false;
+    }
+    return iref;
+}
+
+//============================================================================
+// speed_loop_step()
+// One speed loop period: the current reference for the next, in mA, from
+// the speed and the mean motor current over the last.
+//============================================================================
+int32_t speed_loop_step(speed_loop_t *s, int32_t setpoint_rpm, int32_t speed_rpm,
+                        int32_t current_ma)
+{
+    if (s->feedforward)
+        s->load_ff_ma = load_observer_update(&s->obs, current_ma, speed_rpm, SPEED_LOOP_HZ);
+    else
+        s->load_ff_ma = 0;
+
+    if (s->tuning)
+        return autotune_speed_step(s, speed_rpm);
+    return pi_update(&s->pi, setpoint_rpm - speed_rpm, s->load_ff_ma);
+}
@@ -0,0 +1,425 @@
+//============================================================================
+// tach.c: Tachometer speed measurement by timer input capture.
+//
+// The tach signal goes to PB1 (TIM14_CH1, AF0) as well as to the ADC on
+// PA4.  TIM14 latches its counter on every rising edge, so each edge is
+// timestamped to one timer tick however late the interrupt runs.  The input
+// filter wants six agreeing samples at 6 MHz (1 us) before it passes an
+// edge, which drops switching noise coupled onto the line without adding
+// period error: every edge is delayed the same.
+//
+// TIM14 is only 16 bits (1.37 ms at 48 MHz), so its update interrupt
+// counts overflows to extend the timestamps to 32 bits.
+//
+// Speed is an M/T estimate.  Each window counts the edges in it (M) and
+// ends on an edge, and the time from the edge that ended the previous
+// window is measured in ticks (T).  Then rpm = 60 * M * f / T.  A window
+// runs for at least its length and then closes on the first edge after
+// that.  At high speed it holds many edges and the timing error is one
+// tick over the whole window.  At low speed it stretches to a single
+// period, which is still timed to a tick.  Either way the resolution
+// stays around 1 / (window * f): a few ppm, down to the stall limit.
+//
+// The window length follows the speed: after each estimate it is set to
+// hold TACH_WINDOW_EDGES edges at that speed, clamped to the limits in
+// tach.h, so estimates come faster as the edges do.  The polling follows
+// too: tach_update() only works every quarter window, and every
+// TACH_WATCH_MS while stopped.  The edges themselves are timestamped in
+// their interrupts, so a late poll only delays an estimate and never
+// shifts it.
+//
+// Between edges the last estimate is only held while the next edge could
+// still be on time.  Once an edge is overdue, the motor is slower than the
+// measurement by at least expected / elapsed, because an edge right now
+// would give 60 / elapsed rpm.  The estimate then decays exponentially
+// from the last window's estimate, over the time the next edge is
+// overdue, with one expected period as the time constant, and is capped
+// at that bound.  So it doesn't depend on how often tach_update() gets
+// to look, which follows the window.  If the next edge is a whole
+// expected period late, the motor is taken as stalled.  Before the first
+// estimate that takes TACH_STALL_MS, which also puts the floor at
+// 60000 / (TACH_STALL_MS * TACH_PULSES_PER_REV) rpm: anything slower
+// reads 0.
+//
+// Each estimate goes through the filter chain configured in tach.h, in
+// Q8 rpm.  The median throws out the huge reading from a noise edge at
+// low speed, where a window is a single period.  The chain restarts from
+// the first estimate after a stall.
+//
+// Edges come from one of two detectors, feeding the same estimator:
+//   capture  TIM14 on PB1, for sensors that swing to logic levels
+//   level    the tach's ADC samples on PA4, for anything smaller.  The
+//            threshold follows the signal: leaky running min/max set the
+//            midpoint, and a hysteresis band of a quarter of the swing keeps
+//            ripple near the threshold from counting twice.  The ADC's
+//            analog watchdog does the comparing: its window sits below the
+//            rising threshold while the signal is low and above the falling
+//            one while it is high, and moves over on each crossing.  So
+//            this interrupts twice per tach period and not per sample.
+//            Crossing times are interpolated between samples.
+// The capture path is the finer one and is used whenever it has seen an
+// edge within TACH_STALL_MS; otherwise the level detector counts.  The
+// level detector keeps calibrating either way.
+//============================================================================
+
+#include "stm32f0xx.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "filter.h"
+#include "tach.h"
+
+#define TICKS_RPM ((float)TACH_CLOCK_HZ / TACH_PULSES_PER_REV * 60)
+#define WINDOW_MIN_TICKS ((uint32_t)TACH_CLOCK_HZ / 1000 * TACH_WINDOW_MIN_MS)
+#define WINDOW_MAX_TICKS ((uint32_t)TACH_CLOCK_HZ / 1000 * TACH_WINDOW_MAX_MS)
+#define WATCH_TICKS ((uint32_t)TACH_CLOCK_HZ / 1000 * TACH_WATCH_MS)
+#define STALL_TICKS ((uint32_t)TACH_CLOCK_HZ / 1000 * TACH_STALL_MS)
+#define RPM_Q 8
+#define RPM_MAX ((float)(INT32_MAX >> (RPM_Q + TACH_AVERAGE_SHIFT + 1)))
+
+// running min/max are Q16 raw counts and leak towards each other by
+// 2^-LEVEL_LEAK_SHIFT of the swing per block (0.8 s time constant at
+// 5 kHz), slow enough to hold through a period at the lowest speeds
+#define LEVEL_Q 16
+#define LEVEL_LEAK_SHIFT 12
+
+typedef struct
+{
+    volatile uint32_t count;   // rising edges since power-up
+    volatile uint32_t last;    // timestamp of the newest
+    volatile uint32_t period;  // between the newest two
+} edge_log_t;
+
+static volatile uint32_t overflows = 0;  // upper 16 bits of the timestamp
+static edge_log_t capture_log;
+static edge_log_t level_log;
+static const edge_log_t *source = &capture_log;
+
+// level detector
+static int32_t level_min = 0;
+static int32_t level_max = 0;
+static uint16_t level_rising = 0;
+static uint16_t level_falling = 0;
+static bool level_valid = false;
+static volatile bool level_high = false;
+static volatile bool level_started = false;
+static uint32_t adc_offset;  // tach clock minus ADC clock
+
+// the edge that closed the previous window
+static uint32_t window_edges = 0;
+static uint32_t window_start = 0;
+static bool window_open = false;
+static uint32_t expected = 0;  // mean period over the last window, ticks
+static uint32_t window_ticks = WINDOW_MAX_TICKS;  // current minimum length
+static uint32_t poll_ticks = WATCH_TICKS;
+static uint32_t last_poll = 0;
+static volatile float rpm = 0;
+static float held = 0;  // the last window's estimate, before any decay
+
+#if TACH_MEDIAN_N > 1
+static int32_t median_window[TACH_MEDIAN_N];
+static median_t median;
+#endif
+#if TACH_AVERAGE_SHIFT > 0
+static int32_t average_ring[1 << TACH_AVERAGE_SHIFT];
+static ring_average_t average;
+#endif
+#if TACH_IIR_SHIFT > 0
+static iir_t iir;
+#endif
+static bool filters_primed = false;
+
+// one M/T estimate through the filter chain
+static float filter(float raw)
+{
+    // a noise edge right after a real one can read in the millions;
+    // keep it inside the moving average's running sum
+    if (raw > RPM_MAX)
+        raw = RPM_MAX;
+    int32_t x = (int32_t)(raw * (1 << RPM_Q));
+
+    if (!filters_primed) {
+#if TACH_MEDIAN_N > 1
+        median_reset(&median, x);
+#endif
+#if TACH_AVERAGE_SHIFT > 0
+        ring_average_reset(&average, x);
+#endif
+#if TACH_IIR_SHIFT > 0
+        iir_reset(&iir, x);
+#endif
+        filters_primed = true;
+    }
+#if TACH_MEDIAN_N > 1
+    x = median_update(&median, x);
+#endif
+#if TACH_AVERAGE_SHIFT > 0
+    x = ring_average_update(&average, x);
+#endif
+#if TACH_IIR_SHIFT > 0
+    x = iir_update(&iir, x);
+#endif
+    return (float)x / (1 << RPM_Q);
+}
+
+static void log_edge(edge_log_t *log, uint32_t t)
+{
+    log->period = t - log->last;
+    log->last = t;
+    log->count++;
+}
+
+// the watchdog window that trips on the next crossing
+static void set_window(void)
+{
+    if (!level_valid)
+        adc_watchdog_window(0, ADC_FULL_SCALE);
+    else if (level_high)
+        adc_watchdog_window(level_falling + 1, ADC_FULL_SCALE);
+    else
+        adc_watchdog_window(0, level_rising - 1);
+}
+
+// The watchdog handler: sample is the first outside the window, before
+// the one preceding it.  Anything that isn't a crossing of the current
+// thresholds is a trip left over from before the window moved.
+static void level_crossing(uint16_t sample, uint16_t before, uint32_t time)
+{
+    if (!level_started)
+        return;
+
+    if (level_valid && !level_high && sample >= level_rising) {
+        // interpolate the crossing between this sample and the last
+        uint32_t dt = ADC_TRIGGER_TICKS;
+        if (sample > before && before < level_rising)
+            dt = dt * (uint32_t)(level_rising - before) / (uint32_t)(sample - before);
+        log_edge(&level_log, time + adc_offset - ADC_TRIGGER_TICKS + dt);
+        level_high = true;
+    } else if (level_high && sample <= level_falling) {
+        level_high = false;
+    }
+    set_window();
+}
+
+//============================================================================
+// tach_init()
+// Call before adc_init(), which sets up the level detector's watchdog.
+//============================================================================
+void tach_init(void)
+{
+    RCC->AHBENR |= RCC_AHBENR_GPIOBEN;
+    RCC->APB1ENR |= RCC_APB1ENR_TIM14EN;
+
+    adc_watchdog(ADC_CH_TACH, level_crossing);
+
+#if TACH_MEDIAN_N > 1
+    median_init(&median, median_window, TACH_MEDIAN_N);
+#endif
+#if TACH_AVERAGE_SHIFT > 0
+    ring_average_init(&average, average_ring, TACH_AVERAGE_SHIFT);
+#endif
+#if TACH_IIR_SHIFT > 0
+    iir_init(&iir, TACH_IIR_SHIFT);
+#endif
+
+    // PB1 AF0 (TIM14_CH1)
+    GPIOB->MODER = (GPIOB->MODER & ~GPIO_MODER_MODER1) | GPIO_MODER_MODER1_1;
+    GPIOB->AFR[0] &= ~0x000000F0;
+
+    TIM14->PSC = 0;
+    TIM14->ARR = 0xFFFF;
+    // IC1F = 1000: sampled at fDTS/8 = 6 MHz, N = 6
+    TIM14->CCMR1 = TIM_CCMR1_CC1S_0 | TIM_CCMR1_IC1F_3;
+    TIM14->CCER = TIM_CCER_CC1E;  // rising edge
+    TIM14->DIER = TIM_DIER_CC1IE | TIM_DIER_UIE;
+    TIM14->EGR = TIM_EGR_UG;
+    TIM14->SR = 0;
+    NVIC->ISER[0] |= 1 << TIM14_IRQn;
+    TIM14->CR1 |= TIM_CR1_CEN;
+}
+
+float tach_rpm(void)
+{
+    return rpm;
+}
+
+// last edge to edge from the detector in use, 0 while stopped
+uint32_t tach_period_ticks(void)
+{
+    return window_open ? source->period : 0;
+}
+
+bool tach_using_capture(void)
+{
+    return source == &capture_log;
+}
+
+// current time on the edge timestamps' clock
+static uint32_t tach_now(void)
+{
+    __disable_irq();
+    uint32_t high = overflows;
+    uint32_t count = TIM14->CNT;
+    if ((TIM14->SR & TIM_SR_UIF) && count < 0x8000)
+        high++;
+    __enable_irq();
+    return (high << 16) | count;
+}
+
+//============================================================================
+// tach_level()
+// Calibrates the level detector from one ADC block's tach samples, and
+// moves the watchdog window to match.  Call from the ADC block handler,
+// before tach_update().
+//============================================================================
+void tach_level(const adc_view_t *view)
+{
+    int32_t lo = adc_sample(view, 0);
+    int32_t hi = lo;
+    for (int i = 1; i < CONV_ADC_OVERSAMPLE; i++) {
+        int32_t x = adc_sample(view, i);
+        lo = x < lo ? x : lo;
+        hi = x > hi ? x : hi;
+    }
+
+    if (!level_started) {
+        // the ADC's clock runs with the tach's; fix the origin once, to
+        // within this interrupt's latency
+        uint32_t last = view->time + (CONV_ADC_OVERSAMPLE - 1) * ADC_TRIGGER_TICKS;
+        adc_offset = tach_now() - last;
+        level_min = lo << LEVEL_Q;
+        level_max = hi << LEVEL_Q;
+        level_started = true;
+    }
+
+    int32_t leak = (level_max - level_min) >> LEVEL_LEAK_SHIFT;
+    level_max = (hi << LEVEL_Q) > level_max ? hi << LEVEL_Q : level_max - leak;
+    level_min = (lo << LEVEL_Q) < level_min ? lo << LEVEL_Q : level_min + leak;
+
+    int32_t swing = (level_max - level_min) >> LEVEL_Q;
+    int32_t mid = (level_max + level_min) >> (LEVEL_Q + 1);
+    level_rising = mid + swing / 8;
+    level_falling = mid - swing / 8;
+    level_valid = swing >= TACH_MIN_SWING_RAW;
+    if (!level_valid)
+        level_high = false;  // nothing but noise
+
+    // same priority as the watchdog interrupt, so this can't split a
+    // crossing from its window move
+    set_window();
+}
+
+//============================================================================
+// tach_levels()
+// The level detector's current calibration, in raw ADC counts.
+//============================================================================
+void tach_levels(tach_levels_t *levels)
+{
+    levels->min = level_min >> LEVEL_Q;
+    levels->max = level_max >> LEVEL_Q;
+    levels->rising = level_rising;
+    levels->falling = level_falling;
+    levels->valid = level_valid;
+}
+
+//============================================================================
+// tach_update()
+// Call regularly (from the ADC block); closes a window once it has run
+// its length and seen an edge.
+//============================================================================
+void tach_update(void)
+{
+    uint32_t now = tach_now();
+    if (now - last_poll < poll_ticks)
+        return;
+    last_poll = now;
+
+    // the capture path whenever it is getting edges
+    const edge_log_t *active = &level_log;
+    if (capture_log.count && now - capture_log.last < STALL_TICKS)
+        active = &capture_log;
+    if (active != source) {
+        source = active;
+        window_edges = source->count;
+        window_open = false;
+        expected = 0;
+        rpm = 0;
+        filters_primed = false;
+        window_ticks = WINDOW_MAX_TICKS;
+        poll_ticks = WATCH_TICKS;
+    }
+
+    __disable_irq();
+    uint32_t m = source->count;
+    uint32_t t = source->last;
+    __enable_irq();
+
+    if (!window_open) {
+        // start on the first edge after a stall
+        if (m != window_edges) {
+            window_edges = m;
+            window_start = t;
+            window_open = true;
+            poll_ticks = window_ticks / 4;
+        }
+        return;
+    }
+
+    uint32_t pulses = m - window_edges;
+    uint32_t ticks = t - window_start;
+    uint32_t elapsed = now - t;
+    if (pulses > 0 && ticks >= window_ticks) {
+        rpm = filter(TICKS_RPM * pulses / ticks);
+        held = rpm;
+        expected = ticks / pulses;
+        window_edges = m;
+        window_start = t;
+
+        // the next window, sized for this speed
+        uint32_t length = expected * TACH_WINDOW_EDGES;
+        if (length < WINDOW_MIN_TICKS)
+            length = WINDOW_MIN_TICKS;
+        else if (length > WINDOW_MAX_TICKS)
+            length = WINDOW_MAX_TICKS;
+        window_ticks = length;
+        poll_ticks = length / 4;
+    } else if (elapsed > STALL_TICKS || (expected && elapsed > 2 * expected)) {
+        window_edges = m;
+        window_open = false;
+        expected = 0;
+        rpm = 0;
+        filters_primed = false;
+        window_ticks = WINDOW_MAX_TICKS;
+        poll_ticks = WATCH_TICKS;
+    } else if (expected && elapsed > expected) {
+        // overdue: decay, and never above what an edge now would show
+        float decayed = held * expf(-(float)(elapsed - expected) / expected);
+        float bound = TICKS_RPM / elapsed;
+        rpm = decayed < bound ? decayed : bound;
+    }
+}
+
+//============================================================================
+// TIM14_IRQHandler()
+// A capture and an overflow can be pending together.  A capture in the
+// lower half of the count then came after the wrap, so it takes the
+// overflow that hasn't been counted yet.
+//============================================================================
+void TIM14_IRQHandler(void)
+{
+    uint32_t sr = TIM14->SR;
+
+    if (sr & TIM_SR_CC1IF) {
+        uint32_t capture = TIM14->CCR1;  // clears CC1IF
+        uint32_t high = overflows;
+        if ((sr & TIM_SR_UIF) && capture < 0x8000)
+            high++;
+        log_edge(&capture_log, (high << 16) | capture);
+        TIM14->SR = ~TIM_SR_CC1OF;
+    }
+
+    if (sr & TIM_SR_UIF) {
+        TIM14->SR = ~TIM_SR_UIF;
+        overflows++;
+    }
+}
@@ -0,0 +1,28 @@
+//============================================================================
+// check.h: Pass/fail reporting shared by the host tests.
+//
+// Each check prints one line under the case it belongs to; main() ends
+// with check_summary(), whose result is the exit status.
+//============================================================================
+
+#ifndef __CHECK_H
+#define __CHECK_H
+#include <stdio.h>
+#include <stdbool.h>
+
+static int failures = 0;
+
+static inline void check(bool ok, const char *what)
+{
+    printf("    %-44s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failures++;
+}
+
+static inline int check_summary(void)
+{
+    printf(failures ? "%d checks FAILED\n" : "all checks passed\n", failures);
+    return failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,34 @@
+//============================================================================
+// stm32f0xx.h: The device header for host builds of the firmware modules.
+//
+// Takes the register layouts and bit names from the real header, then
+// moves the peripherals the tested modules touch into ordinary memory,
+// defined by the test.  Nothing emulates the hardware: the test writes the
+// counts and flags an interrupt would see, calls the handler, and clears
+// the flags again itself.
+//============================================================================
+
+#ifndef __HOST_STM32F0XX_H
+#define __HOST_STM32F0XX_H
+
+#include_next "stm32f0xx.h"
+
+extern RCC_TypeDef host_rcc;
+extern GPIO_TypeDef host_gpiob;
+extern TIM_TypeDef host_tim14;
+extern NVIC_Type host_nvic;
+
+#undef RCC
+#undef GPIOB
+#undef TIM14
+#undef NVIC
+#define RCC (&host_rcc)
+#define GPIOB (&host_gpiob)
+#define TIM14 (&host_tim14)
+#define NVIC (&host_nvic)
+
+// single-threaded: the test calls the handlers itself
+#define __disable_irq() ((void)0)
+#define __enable_irq() ((void)0)
+
+#endif
@@ -0,0 +1,48 @@
+//============================================================================
+// motor_model.c: Host-side DC motor model for the loop simulations.
+//============================================================================
+
+#include <stdint.h>
+#include "motor_model.h"
+
+void motor_model_init(motor_model_t *m, float ma_per_rpm_s, float ma_per_rpm,
+                      float current_tau_s, float delay_s)
+{
+    m->ma_per_rpm_s = ma_per_rpm_s;
+    m->ma_per_rpm = ma_per_rpm;
+    m->current_tau_s = current_tau_s;
+    m->load_ma = 0;
+    m->rpm = 0;
+    m->current_ma = 0;
+    m->delay_steps = delay_s / MODEL_DT_S + 0.5f;
+    if (m->delay_steps >= MODEL_DELAY_MAX)
+        m->delay_steps = MODEL_DELAY_MAX - 1;
+    for (int i = 0; i < MODEL_DELAY_MAX; i++)
+        m->history[i] = 0;
+    m->pos = 0;
+}
+
+// Advance by MODEL_DT_S.  The motor can't be driven backwards through a
+// drive-only bridge, and it stops rather than reversing under load.
+void motor_model_step(motor_model_t *m, float current_ref_ma)
+{
+    m->current_ma += (current_ref_ma - m->current_ma) * MODEL_DT_S / m->current_tau_s;
+
+    float torque = m->current_ma - m->ma_per_rpm * m->rpm - m->load_ma;
+    m->rpm += torque * MODEL_DT_S / m->ma_per_rpm_s;
+    if (m->rpm < 0)
+        m->rpm = 0;
+
+    m->history[m->pos] = m->rpm;
+    if (++m->pos >= MODEL_DELAY_MAX)
+        m->pos = 0;
+}
+
+// what the tach reports now: the speed delay_steps ago, in whole rpm
+int32_t motor_model_tach(const motor_model_t *m)
+{
+    int i = m->pos - 1 - m->delay_steps;
+    if (i < 0)
+        i += MODEL_DELAY_MAX;
+    return (int32_t)(m->history[i] + 0.5f);
+}
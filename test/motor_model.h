@@ -0,0 +1,46 @@
+//============================================================================
+// motor_model.h: Host-side DC motor model for the loop simulations.
+//============================================================================
+
+#ifndef __MOTOR_MODEL_H
+#define __MOTOR_MODEL_H
+#include <stdint.h>
+
+// The mechanics are in the units observer.h uses, current per rpm/s and
+// per rpm, so a model and an observer can be set up from the same numbers:
+//
+//     ma_per_rpm_s * d(rpm)/dt = i - ma_per_rpm * rpm - load_ma
+//
+// That is first order, gain 1 / ma_per_rpm, tau = ma_per_rpm_s / ma_per_rpm.
+// The closed current loop is a first-order lag on the reference, and the
+// tach reading lags the shaft by a pure delay, standing in for its window
+// and filter chain.
+#define MODEL_DT_S 1e-4f
+#define MODEL_DELAY_MAX 2000  // 200 ms
+
+// the nominal motor, whose mechanics the load observer's defaults match
+#define MODEL_MA_PER_RPM_S 0.067f
+#define MODEL_MA_PER_RPM 0.033f
+#define MODEL_CURRENT_TAU_S 0.002f
+#define MODEL_TACH_DELAY_S 0.02f
+
+typedef struct
+{
+    float ma_per_rpm_s;
+    float ma_per_rpm;
+    float current_tau_s;
+    float load_ma;
+
+    float rpm;
+    float current_ma;
+    float history[MODEL_DELAY_MAX];
+    int delay_steps;
+    int pos;
+} motor_model_t;
+
+void motor_model_init(motor_model_t *m, float ma_per_rpm_s, float ma_per_rpm,
+                      float current_tau_s, float delay_s);
+void motor_model_step(motor_model_t *m, float current_ref_ma);
+int32_t motor_model_tach(const motor_model_t *m);
+
+#endif
@@ -0,0 +1,164 @@
+//============================================================================
+// sim_autotune.c: Relay auto-tuner against the motor model, on the host.
+//
+// Runs speed_loop.c's auto-tune at SPEED_LOOP_HZ, as motor_control.c
+// does: the speed PI settles at the setpoint, the mean current over the
+// second half of that becomes the relay bias, then the relay drives the
+// current reference.  The Ku and Tu it reports are checked against the
+// model's own ultimate point.  Then the Ziegler-Nichols PI is checked
+// against its formulas, and the loop it was handed to steps the setpoint.
+//
+// The ultimate point comes from the phase crossover of
+//
+//     K e^(-L s) / ((tau s + 1)(tau_i s + 1))
+//
+// with L the tach delay plus half a speed loop period, the mean wait for
+// the relay to see a crossing.  The relay's describing function is exact
+// only for a sinusoidal limit cycle.  On this plant the speed is nearer a
+// triangle, for which 4d / (pi a) reads low by up to 8 / pi^2, so Ku gets
+// a wider tolerance than Tu.  The hysteresis band has to stay small next
+// to the cycle amplitude a, too: the cycle sits where the plant's phase is
+// -pi + asin(eps / a), not at the ultimate point.
+//============================================================================
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "motor_control.h"
+#include "speed_loop.h"
+#include "motor_model.h"
+#include "check.h"
+
+#define LOOP_STEPS ((int)(1.0f / (MODEL_DT_S * SPEED_LOOP_HZ) + 0.5f))
+
+#define KU_TOLERANCE 0.25f
+#define TU_TOLERANCE 0.10f
+
+static int32_t speed;
+static int32_t mean_ma;
+
+// one speed loop period of the model under the loop's current reference
+static void run_period(motor_model_t *m, speed_loop_t *s, int32_t rpm)
+{
+    int32_t iref = speed_loop_step(s, rpm, speed, mean_ma);
+    float acc = 0;
+    for (int i = 0; i < LOOP_STEPS; i++) {
+        motor_model_step(m, iref);
+        acc += m->current_ma;
+    }
+    mean_ma = (int32_t)(acc / LOOP_STEPS);
+    speed = motor_model_tach(m);
+}
+
+// ultimate gain (mA per rpm) and period (speed loop steps) of the model
+static void ultimate_point(float *ku, float *tu)
+{
+    float k = 1.0f / MODEL_MA_PER_RPM;
+    float tau = MODEL_MA_PER_RPM_S / MODEL_MA_PER_RPM;
+    float l = MODEL_TACH_DELAY_S + 0.5f / SPEED_LOOP_HZ;
+
+    // phase falls monotonically through -pi: bisect for the crossover
+    float lo = 0, hi = 3.14159265f / l;
+    for (int i = 0; i < 60; i++) {
+        float w = (lo + hi) / 2;
+        float phase = atanf(w * tau) + atanf(w * MODEL_CURRENT_TAU_S) + w * l;
+        if (phase < 3.14159265f)
+            lo = w;
+        else
+            hi = w;
+    }
+    float w = (lo + hi) / 2;
+    *ku = sqrtf(1 + w * tau * w * tau) * sqrtf(1 + w * MODEL_CURRENT_TAU_S * w * MODEL_CURRENT_TAU_S) / k;
+    *tu = 2 * 3.14159265f / w * SPEED_LOOP_HZ;
+}
+
+// Start the tune at rpm and run the loop until the tuner has finished.
+// Returns false if it failed.
+static bool tune(motor_model_t *m, speed_loop_t *s, int32_t rpm)
+{
+    speed_loop_autotune(s, rpm);
+    while (s->tuning)
+        run_period(m, s, rpm);
+    printf("    relay %ld +/- %ld mA\n", (long)s->tuner.bias, (long)s->tuner.amplitude);
+    return s->tuner.state == AUTOTUNE_DONE;
+}
+
+// Hold rpm with the gains the tuner left in the loop, then step the
+// setpoint by a tenth.  Returns the overshoot, and the time to stay within
+// 2%, in seconds.
+static void closed_loop_step(motor_model_t *m, speed_loop_t *s, int32_t rpm,
+                             float *overshoot, float *settle_s)
+{
+    for (int k = 0; k < 10 * SPEED_LOOP_HZ; k++)
+        run_period(m, s, rpm);
+
+    int32_t goal = rpm + rpm / 10;
+    int32_t peak = speed;
+    int last_out = 0;
+    int steps = 10 * SPEED_LOOP_HZ;
+    for (int k = 0; k < steps; k++) {
+        run_period(m, s, goal);
+        if (speed > peak)
+            peak = speed;
+        if (fabsf((float)(speed - goal)) > 0.02f * (goal - rpm))
+            last_out = k + 1;
+    }
+    *overshoot = (float)(peak - goal) / (goal - rpm);
+    *settle_s = (float)last_out / SPEED_LOOP_HZ;
+    if (last_out >= steps)
+        *settle_s = INFINITY;
+}
+
+static void run_case(const char *name, float load_ma, int32_t rpm)
+{
+    motor_model_t m;
+    speed_loop_t s;
+    const autotune_t *at = &s.tuner;
+    float ku, tu;
+
+    printf("%s: %ld rpm, %.0f mA load\n", name, (long)rpm, load_ma);
+    ultimate_point(&ku, &tu);
+
+    motor_model_init(&m, MODEL_MA_PER_RPM_S, MODEL_MA_PER_RPM, MODEL_CURRENT_TAU_S,
+                     MODEL_TACH_DELAY_S);
+    m.load_ma = load_ma;
+    speed_loop_init(&s);
+    speed = 0;
+    mean_ma = 0;
+    bool done = tune(&m, &s, rpm);
+    check(done, "tuner finished");
+    if (!done)
+        return;
+
+    printf("    Ku %.3f mA/rpm (model %.3f), Tu %.1f steps (model %.1f)\n",
+           at->ku, ku, at->tu, tu);
+    check(fabsf(at->ku - ku) <= KU_TOLERANCE * ku, "Ku within 25% of the model");
+    check(fabsf(at->tu - tu) <= TU_TOLERANCE * tu, "Tu within 10% of the model");
+    check(fabsf(at->pi_kp - 0.45f * at->ku) < 1e-4f * at->ku &&
+          fabsf(at->pi_ki - at->pi_kp * 1.2f / at->tu) < 1e-4f * at->pi_ki,
+          "ZN PI: Kp = 0.45 Ku, Ti = Tu / 1.2");
+    check(fabsf(at->pid_kp - 0.6f * at->ku) < 1e-4f * at->ku &&
+          fabsf(at->pid_ki - at->pid_kp * 2.0f / at->tu) < 1e-4f * at->pid_ki &&
+          fabsf(at->pid_kd - at->pid_kp * at->tu / 8.0f) < 1e-4f * at->pid_kd,
+          "ZN PID: Kp = 0.6 Ku, Ti = Tu / 2, Td = Tu / 8");
+    check(s.new_gains && s.pi.kp == (int32_t)(at->pi_kp * (1 << PI_SHIFT)),
+          "tuned gains handed to the speed PI");
+
+    float overshoot, settle_s;
+    closed_loop_step(&m, &s, rpm, &overshoot, &settle_s);
+    printf("    tuned PI, +10%% step: overshoot %.0f%%, settles in %.2f s\n",
+           overshoot * 100, settle_s);
+    // Ziegler-Nichols aims at quarter-amplitude decay, so a large
+    // overshoot is expected; it has to die out
+    check(overshoot < 1.0f && settle_s < 2.0f, "tuned PI settles a step within 2 s");
+}
+
+int main(void)
+{
+    run_case("light", 100, 3000);
+    run_case("loaded", 500, 3000);
+    run_case("fast", 200, 5000);
+
+    return check_summary();
+}
@@ -0,0 +1,96 @@
+//============================================================================
+// sim_load_step.c: Load-step recovery with and without the load observer.
+//
+// speed_loop.c, as motor_control.c runs it at SPEED_LOOP_HZ with its
+// default gains, holds the motor model at speed while the load current
+// steps up.  It runs once with the speed PI alone and once with the load
+// observer's estimate fed forward into the current reference, as
+// USE_LOAD_OBSERVER does, and compares the speed dip and the time back
+// within 1%.
+//============================================================================
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "motor_control.h"
+#include "speed_loop.h"
+#include "motor_model.h"
+#include "check.h"
+
+#define LOOP_STEPS ((int)(1.0f / (MODEL_DT_S * SPEED_LOOP_HZ) + 0.5f))
+#define SETTLE_S 5
+#define RUN_S 5
+#define RECOVERED 0.01f
+
+typedef struct
+{
+    int32_t dip;       // deepest speed error after the step, rpm
+    float recover_s;   // until it stays within RECOVERED of the setpoint
+} recovery_t;
+
+static recovery_t load_step(int32_t rpm, float load_from, float load_to, bool feedforward)
+{
+    motor_model_t m;
+    speed_loop_t s;
+    recovery_t r = { 0, 0 };
+    int32_t speed = 0;
+    int32_t mean_ma = 0;
+
+    motor_model_init(&m, MODEL_MA_PER_RPM_S, MODEL_MA_PER_RPM, MODEL_CURRENT_TAU_S,
+                     MODEL_TACH_DELAY_S);
+    m.load_ma = load_from;
+    speed_loop_init(&s);
+    s.feedforward = feedforward;
+
+    int last_out = 0;
+    for (int k = 0; k < (SETTLE_S + RUN_S) * SPEED_LOOP_HZ; k++) {
+        bool after = k >= SETTLE_S * SPEED_LOOP_HZ;
+        if (after)
+            m.load_ma = load_to;
+
+        int32_t iref = speed_loop_step(&s, rpm, speed, mean_ma);
+
+        // the mean current over the period, as motor_control.c accumulates it
+        float acc = 0;
+        for (int i = 0; i < LOOP_STEPS; i++) {
+            motor_model_step(&m, iref);
+            acc += m.current_ma;
+        }
+        mean_ma = (int32_t)(acc / LOOP_STEPS);
+        speed = motor_model_tach(&m);
+
+        if (after) {
+            if (rpm - speed > r.dip)
+                r.dip = rpm - speed;
+            if (fabsf((float)(speed - rpm)) > RECOVERED * rpm)
+                last_out = k + 1 - SETTLE_S * SPEED_LOOP_HZ;
+        }
+    }
+    r.recover_s = (float)last_out / SPEED_LOOP_HZ;
+    return r;
+}
+
+static void run_case(int32_t rpm, float load_from, float load_to)
+{
+    printf("%ld rpm, load %.0f -> %.0f mA\n", (long)rpm, load_from, load_to);
+    recovery_t off = load_step(rpm, load_from, load_to, false);
+    recovery_t on = load_step(rpm, load_from, load_to, true);
+
+    printf("    speed PI only:     dip %4ld rpm, back within 1%% in %.2f s\n",
+           (long)off.dip, off.recover_s);
+    printf("    with feedforward:  dip %4ld rpm, back within 1%% in %.2f s\n",
+           (long)on.dip, on.recover_s);
+    check(on.dip < off.dip, "feedforward reduces the dip");
+    check(on.recover_s < off.recover_s, "feedforward recovers sooner");
+    check(on.recover_s < RUN_S, "recovers with feedforward");
+}
+
+int main(void)
+{
+    run_case(3000, 100, 600);
+    run_case(1500, 0, 400);
+    run_case(5000, 200, 1200);
+
+    return check_summary();
+}
@@ -0,0 +1,226 @@
+//============================================================================
+// test_filter.c: Checks and per-stage timings for filter.c, on the host.
+//
+// Each stage is checked against a straightforward reference over a fixed
+// pseudo-random sequence, plus the behaviour the tach chain relies on.
+// Then each is timed over BENCH_SAMPLES updates.  Host nanoseconds are
+// only good for comparing stages with each other, not for target cycles.
+//============================================================================
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include "filter.h"
+#include "check.h"
+
+#define TEST_SAMPLES 10000
+#define BENCH_SAMPLES 10000000
+
+// same sequence every run: Q8 rpm-like values with some spikes
+static int32_t sample(uint32_t *seed)
+{
+    *seed = *seed * 1664525u + 1013904223u;
+    int32_t x = 1000 << 8;
+    x += (int32_t)(*seed >> 16) - 32768;
+    if ((*seed & 0xFF) == 0)
+        x += 400000;  // a noise edge
+    return x;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_int32(const void *a, const void *b)
+{
+    int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void test_ring_average(void)
+{
+    enum { SHIFT = 3, N = 1 << SHIFT };
+    int32_t ring[N], history[N] = { 0 };
+    ring_average_t f;
+    uint32_t seed = 1;
+    bool match = true;
+
+    printf("ring_average, 1 << %d\n", SHIFT);
+    ring_average_init(&f, ring, SHIFT);
+    for (int i = 0; i < TEST_SAMPLES; i++) {
+        int32_t x = sample(&seed);
+        history[i % N] = x;
+        int64_t sum = 0;
+        for (int j = 0; j < N; j++)
+            sum += history[j];
+        if (ring_average_update(&f, x) != (int32_t)(sum >> SHIFT))
+            match = false;
+    }
+    check(match, "matches the mean of the last 1 << shift");
+
+    ring_average_reset(&f, 5000);
+    check(ring_average_update(&f, 5000) == 5000, "starts from the reset value");
+}
+
+static void test_median(void)
+{
+    enum { N = 5 };
+    int32_t window[N], history[N] = { 0 }, sorted[N];
+    median_t f;
+    uint32_t seed = 2;
+    bool match = true;
+
+    printf("median, n = %d\n", N);
+    median_init(&f, window, N);
+    for (int i = 0; i < TEST_SAMPLES; i++) {
+        int32_t x = sample(&seed);
+        history[i % N] = x;
+        for (int j = 0; j < N; j++)
+            sorted[j] = history[j];
+        qsort(sorted, N, sizeof sorted[0], cmp_int32);
+        if (median_update(&f, x) != sorted[N / 2])
+            match = false;
+    }
+    check(match, "matches a sorted reference");
+
+    median_reset(&f, 100);
+    int32_t y = median_update(&f, 100000);
+    y = median_update(&f, 100000);
+    check(y == 100, "drops (n - 1) / 2 wild samples");
+    y = median_update(&f, 100000);
+    check(y == 100000, "follows once they are the majority");
+}
+
+static void test_iir(void)
+{
+    enum { SHIFT = 2 };
+    iir_t f;
+    uint32_t seed = 3;
+    int32_t ref = 0;
+    bool match = true;
+
+    printf("iir, alpha 1 / 2^%d\n", SHIFT);
+    iir_init(&f, SHIFT);
+    for (int i = 0; i < TEST_SAMPLES; i++) {
+        int32_t x = sample(&seed);
+        ref += (x - ref) >> SHIFT;
+        if (iir_update(&f, x) != ref)
+            match = false;
+    }
+    check(match, "matches y += (x - y) >> shift");
+
+    iir_reset(&f, 0);
+    int32_t y = 0;
+    int k = 0;
+    while (y < (1000 << 8) * 63 / 100 && k < 100) {
+        y = iir_update(&f, 1000 << 8);
+        k++;
+    }
+    check(k >= (1 << SHIFT) - 1 && k <= (1 << SHIFT) + 1, "63% of a step in about 2^shift samples");
+}
+
+// order moving sums of ratio samples, every ratio'th: what a CIC computes
+static void test_cic_order(int order, int ratio)
+{
+    cic_t f;
+    uint32_t seed = 4;
+    uint32_t history[CIC_MAX_ORDER + 1][256] = { { 0 } };
+    bool match = true;
+    int outputs = 0;
+
+    cic_init(&f, order, ratio);
+    for (int i = 0; i < TEST_SAMPLES; i++) {
+        // ADC block sums, 14 bits
+        uint32_t x = (uint32_t)(sample(&seed) >> 4) & 0x3FFF;
+        history[0][i % ratio] = x;
+        for (int n = 1; n <= order; n++) {
+            uint32_t sum = 0;
+            for (int j = 0; j < ratio; j++)
+                sum += history[n - 1][j];
+            history[n][i % ratio] = sum;
+        }
+
+        uint32_t y;
+        if (cic_update(&f, x, &y)) {
+            outputs++;
+            if (y != history[order][i % ratio])
+                match = false;
+        }
+    }
+    printf("cic, order %d, ratio %d\n", order, ratio);
+    check(match && outputs == TEST_SAMPLES / ratio, "matches cascaded moving sums, decimated");
+}
+
+static void test_cic(void)
+{
+    test_cic_order(1, 5);
+    test_cic_order(2, 16);
+    test_cic_order(3, 8);
+
+    // full scale for long enough that the integrators wrap many times
+    cic_t f;
+    uint32_t y = 0;
+    bool steady = true;
+    cic_init(&f, 2, 64);
+    for (int i = 0; i < 100000; i++) {
+        if (cic_update(&f, 16380, &y) && i > 2 * 64 && y != 16380 * cic_gain(&f))
+            steady = false;
+    }
+    check(steady, "full scale survives integrator wrap");
+}
+
+// time n updates of one stage, ns per sample
+#define BENCH(name, update)                                     \
+    do {                                                        \
+        uint32_t seed = 9;                                      \
+        double t0 = now_ns();                                   \
+        for (int i = 0; i < BENCH_SAMPLES; i++)                 \
+            sink = update;                                      \
+        double ns = (now_ns() - t0) / BENCH_SAMPLES;            \
+        printf("    %-20s %6.2f ns/sample\n", name, ns);        \
+    } while (0)
+
+// keeps the optimiser from dropping the updates
+static volatile int32_t sink;
+
+static void bench(void)
+{
+    int32_t ring[1 << 3], window3[3], window7[7];
+    ring_average_t avg;
+    median_t med3, med7;
+    iir_t iir;
+    cic_t cic1, cic2;
+    uint32_t y;
+
+    ring_average_init(&avg, ring, 3);
+    median_init(&med3, window3, 3);
+    median_init(&med7, window7, 7);
+    iir_init(&iir, 2);
+    cic_init(&cic1, 1, 5);
+    cic_init(&cic2, 2, 16);
+
+    printf("cost per stage, host\n");
+    BENCH("input only", sample(&seed));
+    BENCH("ring_average 1 << 3", ring_average_update(&avg, sample(&seed)));
+    BENCH("median 3", median_update(&med3, sample(&seed)));
+    BENCH("median 7", median_update(&med7, sample(&seed)));
+    BENCH("iir 1 / 4", iir_update(&iir, sample(&seed)));
+    BENCH("cic 1, ratio 5", cic_update(&cic1, sample(&seed), &y));
+    BENCH("cic 2, ratio 16", cic_update(&cic2, sample(&seed), &y));
+}
+
+int main(void)
+{
+    test_ring_average();
+    test_median();
+    test_iir();
+    test_cic();
+    bench();
+
+    return check_summary();
+}
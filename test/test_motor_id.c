@@ -0,0 +1,64 @@
+//============================================================================
+// test_motor_id.c: The fixed-point RLS of motor_id.c against known plants.
+//
+// Each plant is the discrete first-order model motor_id.c fits, at the
+// speed loop rate, driven by a current that steps at random around a mean
+// as the speed loop's would.  The speed is rounded to whole rpm as the
+// tach reports it.  The gain and time constant motor_id_model() reports
+// after the run are checked against the plant's.
+//============================================================================
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "motor_id.h"
+#include "motor_control.h"
+#include "check.h"
+
+#define RUN_S 60
+#define HOLD_STEPS 20      // speed loop steps per current level
+#define TOLERANCE 0.05f
+
+static void run_case(const char *name, float rpm_per_ma, float tau_s,
+                     int32_t mean_ma, int32_t swing_ma)
+{
+    float ts = 1.0f / SPEED_LOOP_HZ;
+    float a = expf(-ts / tau_s);
+    float b = rpm_per_ma * (1 - a);
+    motor_id_t id;
+    uint32_t seed = 5;
+    int32_t current = mean_ma;
+    float speed = rpm_per_ma * mean_ma;
+
+    printf("%s: %.1f rpm/mA, tau %.2f s, %ld +/- %ld mA\n",
+           name, rpm_per_ma, tau_s, (long)mean_ma, (long)swing_ma);
+    motor_id_init(&id);
+    for (int k = 0; k < RUN_S * SPEED_LOOP_HZ; k++) {
+        if (k % HOLD_STEPS == 0) {
+            seed = seed * 1664525u + 1013904223u;
+            current = mean_ma + (int32_t)(seed >> 16) % (2 * swing_ma + 1) - swing_ma;
+        }
+        speed = a * speed + b * current;
+        motor_id_update(&id, (int32_t)(speed + 0.5f), current);
+    }
+
+    float gain, tau;
+    bool valid = motor_id_model(&id, ts, &gain, &tau);
+    check(valid, "model valid");
+    if (!valid)
+        return;
+    printf("    found %.2f rpm/mA, tau %.3f s\n", gain, tau);
+    check(fabsf(gain - rpm_per_ma) < TOLERANCE * rpm_per_ma, "gain within 5%");
+    check(fabsf(tau - tau_s) < TOLERANCE * tau_s, "time constant within 5%");
+}
+
+int main(void)
+{
+    // the nominal mechanics of motor_control.c's load observer
+    run_case("nominal", 1 / 0.033f, 0.067f / 0.033f, 200, 100);
+    run_case("fast", 10, 0.3f, 600, 300);
+    run_case("high gain", 60, 1, 100, 50);
+
+    return check_summary();
+}
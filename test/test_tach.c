@@ -0,0 +1,132 @@
+//============================================================================
+// test_tach.c: The tach's M/T estimator against timed edges, on the host.
+//
+// Feeds tach.c capture edges at a steady speed through TIM14_IRQHandler()
+// and calls tach_update() once per ADC block, as main.c does, so it only
+// does its work every poll_ticks.  Now and then one edge comes LATE
+// periods after the last.  While it is overdue the reading must come down
+// no further than the decay from the last estimate allows, and it has to
+// come down at all, or the late edges never landed between polls.  The
+// speeds cover a window clamped at its maximum, one sized by the speed,
+// and one clamped at its minimum.
+//============================================================================
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "stm32f0xx.h"
+#include "adc.h"
+#include "tach.h"
+#include "check.h"
+
+#define BLOCK_TICKS (TACH_CLOCK_HZ / CONV_LOOP_HZ)
+#define SETTLE_S 1
+#define LATE 1.5f    // a late edge's period, in expected periods
+#define AFTER 30     // on-time periods after each
+#define REPEATS 8    // late edges, each at a different point between polls
+#define FLOOR 0.55f  // exp(-(LATE - 1)) less a margin for the filters
+
+RCC_TypeDef host_rcc;
+GPIO_TypeDef host_gpiob;
+TIM_TypeDef host_tim14;
+NVIC_Type host_nvic;
+
+// the vector table's, in tach.c
+void TIM14_IRQHandler(void);
+
+// the level detector never sees a signal here
+void adc_watchdog(adc_channel_t ch, adc_watchdog_fn on_exit)
+{
+    (void)ch;
+    (void)on_exit;
+}
+
+void adc_watchdog_window(uint16_t low, uint16_t high)
+{
+    (void)low;
+    (void)high;
+}
+
+uint16_t adc_sample(const adc_view_t *view, int i)
+{
+    (void)view;
+    (void)i;
+    return 0;
+}
+
+static uint32_t now = 0;         // tach ticks
+static uint32_t next_block = 0;  // next tach_update() call
+
+// run the clock to t, with the overflow interrupts on the way
+static void advance(uint32_t t)
+{
+    while ((now >> 16) != (t >> 16)) {
+        now = (now | 0xFFFF) + 1;
+        TIM14->CNT = 0;
+        TIM14->SR = TIM_SR_UIF;
+        TIM14_IRQHandler();
+        TIM14->SR = 0;
+    }
+    now = t;
+    TIM14->CNT = now & 0xFFFF;
+}
+
+// every ADC block up to t, keeping the lowest reading
+static void run_blocks(uint32_t t, float *low)
+{
+    while ((int32_t)(next_block - t) <= 0) {
+        advance(next_block);
+        tach_update();
+        float rpm = tach_rpm();
+        if (low && rpm < *low)
+            *low = rpm;
+        next_block += BLOCK_TICKS;
+    }
+    advance(t);
+}
+
+static void edge_at(uint32_t t, float *low)
+{
+    run_blocks(t, low);
+    TIM14->CCR1 = t & 0xFFFF;
+    TIM14->SR = TIM_SR_CC1IF;
+    TIM14_IRQHandler();
+    TIM14->SR = 0;
+}
+
+static void late_edge(float rpm)
+{
+    double period = (double)TACH_CLOCK_HZ * 60 / (rpm * TACH_PULSES_PER_REV);
+    double t = now + period;
+    int edges = (int)(SETTLE_S * TACH_CLOCK_HZ / period);
+
+    printf("%.0f rpm, %d edges %.1f periods apart\n", rpm, REPEATS, LATE);
+    for (int i = 0; i < edges; i++, t += period)
+        edge_at((uint32_t)t, NULL);
+    float before = tach_rpm();
+    check(before > 0.99f * rpm && before < 1.01f * rpm, "reads the speed before");
+
+    float low = before;
+    for (int k = 0; k < REPEATS; k++) {
+        t += (LATE - 1) * period;
+        for (int i = 0; i < AFTER; i++, t += period)
+            edge_at((uint32_t)t, &low);
+    }
+    printf("    lowest reading %.0f rpm (%.0f%%)\n", low, 100 * low / before);
+    check(low < 0.99f * before, "decays while an edge is overdue");
+    check(low > FLOOR * before, "a late edge doesn't collapse the estimate");
+    check(tach_rpm() > 0.99f * rpm && tach_rpm() < 1.01f * rpm, "reads the speed after");
+
+    // stop, so the next case starts from a stall
+    run_blocks(now + TACH_CLOCK_HZ, NULL);
+}
+
+int main(void)
+{
+    tach_init();
+    late_edge(3000);    // 20 ms, window at its 10 ms maximum
+    late_edge(30000);   // 2 ms, window of 4 edges
+    late_edge(137000);  // 0.44 ms, window at its 2 ms minimum
+
+    return check_summary();
+}